@@ -0,0 +1,105 @@
+/**
+ * lisp-forty, a lisp interpreter
+ * Copyright (C) 2014-16 Sean Anderson
+ *
+ * This file is part of lisp-forty.
+ *
+ * lisp-forty is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lisp-forty.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef WINDOWS
+#include <io.h>
+#define write _write
+#else
+#include <unistd.h>
+#endif
+
+#include "lisp.h"
+
+//Everything printed to stdout goes through here
+lbuf lbuf_out = {1, NULL, 0, 0};
+
+//Write out everything in b, if it has somewhere to go
+bool lbuf_flush(lbuf* b) {
+
+	if(b->fd < 0) return true;
+
+	bool ok = true;
+	for(size_t done = 0; done < b->len;) {
+		ssize_t n = write(b->fd, b->data + done, b->len - done);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) {
+			ok = false;  //Nothing we can do about it, so drop the rest
+			break;
+		}
+		done += (size_t) n;
+	}
+	b->len = 0;
+	return ok;
+
+}
+
+//For atexit()
+void lbuf_flush_out() {
+
+	lbuf_flush(&lbuf_out);
+
+}
+
+void lbuf_write(lbuf* b, char* data, size_t len) {
+
+	if(b->len + len > b->max) {
+		if(b->fd >= 0 && b->len) lbuf_flush(b);
+		if(b->fd >= 0 && len >= LBUF_SIZE) {  //Too big to be worth copying
+			lbuf tmp = {b->fd, data, len, len};
+			lbuf_flush(&tmp);
+			return;
+		}
+		if(b->len + len > b->max) {
+			if(!b->max) b->max = b->fd >= 0 ? LBUF_SIZE : 64;
+			while(b->len + len > b->max) b->max *= 2;
+			b->data = realloc(b->data, b->max);
+		}
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+
+}
+
+void lbuf_putc(lbuf* b, char c) {
+
+	if(b->len == b->max) lbuf_write(b, &c, 1);
+	else b->data[b->len++] = c;
+
+}
+
+void lbuf_puts(lbuf* b, char* str) {
+
+	lbuf_write(b, str, strlen(str));
+
+}
+
+void lbuf_num(lbuf* b, long num) {
+
+	char digits[sizeof(long) * CHAR_BIT / 3 + 2];
+	char* c = digits + sizeof(digits);
+	unsigned long n = num < 0 ? 0 - (unsigned long) num : (unsigned long) num;
+	do {
+		*--c = (char) ('0' + n % 10);
+		n /= 10;
+	} while(n);
+	if(num < 0) *--c = '-';
+	lbuf_write(b, c, digits + sizeof(digits) - c);
+
+}
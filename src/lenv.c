@@ -20,31 +20,6 @@
 
 #include "lisp.h"
 
-/* djb2 by Dan Bernstein
- * This and the next function retrieved from <http://www.cse.yorku.ca/~oz/hash.html> on 6/29/14
- */
-unsigned long djb2(char* str){
-
-	unsigned long hash = 5381;  //Magic starting number
-
-	for(char c = *str; c != '\0'; c = *str++)
-		hash = ((hash << 5) + hash) + c;  //Multiply by 33 and add c
-
-	return hash;
-}
-
-//Same as above but with different magic numbers
-unsigned long sdbm(char* str){
-
-	unsigned long hash = 0;  //Another magic number
-
-	for(char c = *str; c != '\0'; c = *str++)
-		hash = ((hash << 6) + (hash << 16) - hash) + c;  //Multiply by 65599
-
-	return hash;
-
-}
-
 //Helper function to sanity-check sizes
 inline static int lenv_size_check(int size) {
 
@@ -56,8 +31,9 @@ inline static int lenv_size_check(int size) {
 lenv* lenv_new(int size) {
 
 	if(!lenv_size_check(size)) return NULL;
-	lenv* e = malloc(sizeof(lenv));
+	lenv* e = lpool_alloc(&lenv_pool);
 	e->par = NULL;
+	e->flat = false;
 	e->max = size;
 	e->count = 0;
 	e->table = malloc(sizeof(lentry) * e->max);
@@ -69,14 +45,20 @@ lenv* lenv_new(int size) {
 
 }
 
+//Create a new local frame
+lenv* lenv_frame(int size) {
+
+	lenv* e = lenv_new(size);
+	if(e) e->flat = true;
+	return e;
+
+}
+
 //Delete an lenv
 void lentry_del(lentry* e, int size) {
 
 	for(int i = 0; i < size; i++) {  //Delete the lentries in e->table
-		if(e[i].v != NULL) {
-			free(e[i].sym);
-			lval_del(e[i].v);
-		}
+		if(e[i].v != NULL) lval_del(e[i].v);  //Symbols are interned, so we don't own them
 	}
 	free(e);
 
@@ -84,8 +66,43 @@ void lentry_del(lentry* e, int size) {
 
 void lenv_del(lenv* e) {
 
+#ifdef LISP_GC_MARK_SWEEP
+	UNUSED(e);  //lpool_collect() frees e once nothing can reach it
+#else
+	lenv_clear(e);
+	lpool_free(&lenv_pool, e);
+#endif
+
+}
+
+//Free e's table, but not e itself
+void lenv_clear(lenv* e) {
+
 	lentry_del(e->table, e->max);
-	free(e);
+
+}
+
+/* Find the slot for the interned symbol sym
+ * Returns either the slot holding sym or the empty slot where it should go
+ */
+static int lenv_find(lenv* e, char* sym, unsigned long hash) {
+
+	if(e->flat) {  //Frames are small enough to just look through
+		int slot;
+		for(slot = 0; slot < e->count; slot++)
+			if(e->table[slot].sym == sym) break;
+		return slot;
+	}
+
+	int slot = (int) (hash % e->max);  //Main hash
+
+	if((e->table[slot].sym != NULL) && (e->table[slot].sym != sym)) {
+		int dhash = (int) (9 - 2 * (LSYM(sym)->dhash % 5));  //The jump is from 1-9 odds
+		for(; (e->table[slot].sym != NULL);  slot = (slot + dhash) % e->max)  //Loop until we find an open spot
+			if(e->table[slot].sym == sym) break; //The symbols match, so we overwrite the data
+	}
+
+	return slot;
 
 }
 
@@ -94,29 +111,49 @@ void lenv_resize(lenv* e, int size) {
 	if(!lenv_size_check(size)) return;
 	if(size < e->max) return;  //We can't make the hashtable smaller
 
+	if(e->flat) {  //Frames don't hash, so the entries can stay where they are
+		e->table = realloc(e->table, sizeof(lentry) * size);
+		for(int i = e->max; i < size; i++) {
+			e->table[i].sym = NULL;
+			e->table[i].v = NULL;
+		}
+		e->max = size;
+		return;
+	}
+
 	int tmp_max = e->max;
-	lentry* tmp = malloc(sizeof(lentry) * tmp_max);  //Stick e->table in a tmp array while we make a new table
-	memcpy(tmp, e->table, sizeof(lentry) * tmp_max);
-	free(e->table);
+	lentry* tmp = e->table;  //Hang on to the old table while we make a new one
 
 	e->table = malloc(sizeof(lentry) * size);  //Init the new table
-	e->count = 0;
 	e->max = size;
 	for(int i = 0; i < e->max; i++) {
 		e->table[i].sym = NULL;
 		e->table[i].v = NULL;
 	}
 
-	for(int i = 0; i < tmp_max; i++)  //Insert the elements
+	for(int i = 0; i < tmp_max; i++)  //Move the elements over
 		if(tmp[i].sym != NULL) {
-			lval* k = lval_sym(tmp[i].sym);
-			lval* v = lval_copy(tmp[i].v);
-			lenv_put(e, k, v);
-			lval_del(k);
-			lval_del(v);
+			int slot = lenv_find(e, tmp[i].sym, LSYM(tmp[i].sym)->hash);
+			e->table[slot] = tmp[i];
 		}
 
-	lentry_del(tmp, tmp_max);
+	free(tmp);
+
+}
+
+//Find the slot for sym, claiming an empty one if it isn't bound yet
+static int lenv_insert(lenv* e, char* sym, unsigned long hash) {
+
+	if(e->flat) {
+		if(e->count == e->max) lenv_resize(e, e->max * 2);  //Frames fill up completely before they grow
+	} else if(((float) e->count)/((float) e->max) > 0.75f) lenv_resize(e, e->max * 8);  //Resize if the table is full
+
+	int slot = lenv_find(e, sym, hash);
+	if(e->table[slot].sym == NULL) {
+		e->table[slot].sym = sym;
+		e->count++;
+	}
+	return slot;
 
 }
 
@@ -124,64 +161,64 @@ void lenv_resize(lenv* e, int size) {
 //You must free k and v
 void lenv_put(lenv* e, lval* k, lval* v){
 
-	if(((float) e->count)/((float) e->max) > 0.75f) lenv_resize(e, e->max * 8);  //Resize if the table is full
+	if(!e->flat) v = lval_promote(v);  //Only frames go away with the form that made them
+	int slot = lenv_insert(e, k->str, k->hash);
+	if(e->table[slot].v != NULL) lval_del(e->table[slot].v);  //Free the old data if we're redefining the symbol
+	e->table[slot].v = lval_copy(v);
 
-	int hash = (int) (djb2(k->str) % e->max);  //Main hash
+}
 
-	if((e->table[hash].sym != NULL) && (strcmp(e->table[hash].sym, k->str) != 0)){
-		int dhash = (int) (9 - 2 * (sdbm(k->str) % 5));  //The jump is from 1-9 odds
-		for(; (e->table[hash].sym != NULL);  hash = (hash + dhash) % e->max)  //Loop until we find an open spot
-			if(strcmp(e->table[hash].sym, k->str) == 0) break; //The strings match, so we overwrite the data
-	}
-	
-	if(e->table[hash].sym != NULL){
-		free(e->table[hash].sym);  //Free the old data if we're redefining the symbol
-		lval_del(e->table[hash].v);
-	}
+//Same as lenv_put, but takes over v
+void lenv_bind(lenv* e, lval* k, lval* v){
+
+	int slot = lenv_insert(e, k->str, k->hash);
+	if(e->table[slot].v != NULL) lval_del(e->table[slot].v);
+	e->table[slot].v = v;
+
+}
+
+/* Move every binding in from that isn't shadowed by one in e over to e
+ * This is used when a tail call replaces from with e, so from is left empty
+ */
+void lenv_absorb(lenv* e, lenv* from) {
+
+	for(int i = 0; i < from->max; i++) {
+		if(from->table[i].sym == NULL) continue;
 
-	e->table[hash].sym = malloc(strlen(k->str) + 1);  //And put in the new
-	strcpy(e->table[hash].sym, k->str);
-	e->table[hash].v = lval_copy(v);
+		char* sym = from->table[i].sym;
+		int slot = lenv_insert(e, sym, LSYM(sym)->hash);
+		if(e->table[slot].v == NULL) e->table[slot].v = from->table[i].v;
+		else lval_del(from->table[i].v);
 
-	e->count++;
+		from->table[i].sym = NULL;
+		from->table[i].v = NULL;
+	}
+	from->count = 0;
 
 }
 
 lval* lenv_get(lenv* e, lval* k) {
 
-	int hash = (int) (djb2(k->str) % e->max);  //The next few lines are the same as lenv_put()
-
-	// Check to see if we need to generate a delta-hash first
-	if((e->table[hash].sym != NULL) && (strcmp(e->table[hash].sym, k->str) != 0)) {
-		int dhash = (int) (9 - 2 * (sdbm(k->str) % 5));
-		for(; (e->table[hash].sym != NULL);  hash = (hash + dhash) % e->max)
-			if(strcmp(e->table[hash].sym, k->str) == 0) break;
+	for(; e; e = e->par) {  //Check each scope in turn
+		int slot = lenv_find(e, k->str, k->hash);
+		if(slot < e->max && e->table[slot].sym != NULL) return lval_copy(e->table[slot].v);
 	}
 
-	if(e->table[hash].sym != NULL) return lval_copy(e->table[hash].v);
-	if(e->par)
-		return lenv_get(e->par, k);
-	else
-		return lval_err("unbound symbol: \"%s\"", k->str);
+	return lval_err("unbound symbol: \"%s\"", k->str);
 
 }
 
 lenv* lenv_copy(lenv* e) {
 
-	lenv* x = malloc(sizeof(lenv));
+	lenv* x = lpool_alloc(&lenv_pool);
 	x->par = e->par;
+	x->flat = e->flat;
 	x->max = e->max;
 	x->count = e->count;
 	x->table = malloc(sizeof(lentry) * x->max);
 	for(int i = 0; i < x->max; i++) {  //Copy over the elements
-		if(e->table[i].sym != NULL) {
-			x->table[i].sym = malloc(strlen(e->table[i].sym) + 1);
-			strcpy(x->table[i].sym, e->table[i].sym);
-			x->table[i].v = lval_copy(e->table[i].v);
-		} else {  //If there's nothing there, there's nothing to copy
-			x->table[i].sym = NULL;
-			x->table[i].v = NULL;
-		}
+		x->table[i].sym = e->table[i].sym;
+		x->table[i].v = e->table[i].sym != NULL ? lval_copy(e->table[i].v) : NULL;  //If there's nothing there, there's nothing to copy
 	}
 	return x;
 
@@ -194,9 +231,21 @@ void lenv_def(lenv* e, lval* k, lval* v) {
 
 }
 
+//Every builtin that has been added, so they can be found by name, see lser.c
+static struct lbuiltin_entry {
+	char* name;  //Interned
+	lbuiltin func;
+}* lbuiltins = NULL;
+static int lbuiltin_count = 0;
+
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
 
 	lval* k = lval_sym(name);
+	if(lbuiltin_find(k->str) == NULL) {
+		lbuiltins = realloc(lbuiltins, sizeof(struct lbuiltin_entry) * (lbuiltin_count + 1));
+		lbuiltins[lbuiltin_count].name = k->str;
+		lbuiltins[lbuiltin_count++].func = func;
+	}
 	lval* v = lval_func(func);
 	lenv_put(e, k, v);
 	lval_del(k);
@@ -204,6 +253,23 @@ void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
 
 }
 
+//The name func was first added under
+char* lbuiltin_name(lbuiltin func) {
+
+	for(int i = 0; i < lbuiltin_count; i++)
+		if(lbuiltins[i].func == func) return lbuiltins[i].name;
+	return NULL;
+
+}
+
+lbuiltin lbuiltin_find(char* name) {
+
+	for(int i = 0; i < lbuiltin_count; i++)
+		if(lbuiltins[i].name == name) return lbuiltins[i].func;
+	return NULL;
+
+}
+
 lval* lenv_equals(lenv* x, lenv* y) {
 
 	if(x == y) return LVAL_TRUE;
@@ -214,14 +280,7 @@ lval* lenv_equals(lenv* x, lenv* y) {
 	for(int i = 0; i < x->count; i++) {
 		lentry xent = x->table[i];
 		lentry yent = y->table[i];
-		if(xent.sym == yent.sym) {
-			//do nothing
-		} else if((xent.sym == NULL) || (yent.sym == NULL)) {//Either one or the other is null but not both
-			return LVAL_FALSE;
-		} else if(strcmp(xent.sym, yent.sym) != 0) {
-			return LVAL_FALSE;
-		}
-		//sym is equal literally or lexically
+		if(xent.sym != yent.sym) return LVAL_FALSE;  //Symbols are interned, so we can compare pointers
 		if(xent.v == yent.v) {
 			//do nothing
 		} else if((xent.v == NULL) || (yent.v == NULL)) {
@@ -21,15 +21,48 @@
 #ifndef LISP_H
 #define LISP_H
 
-#include "mpc.h"
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 struct lval;
 struct lenv;
+struct lcode;
+struct largs;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct largs largs;
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/* Immutable bytes shared by strings, see lstr.c
+ * A leaf keeps its bytes right after itself. A concatenation points at its two
+ * halves until something needs its bytes, when they get copied into data and
+ * the halves are let go. A view points into the bytes of the lstr in left.
+ */
+typedef struct lstr {
+	int refs;
+	int len;
+	int depth;  //Longest path down through left and right
+	char* data;  //NULL for a concatenation which hasn't been flattened yet
+	struct lstr* left;
+	struct lstr* right;
+} lstr;
+
+//One key and its value in a map, see lmap.c
+typedef struct lmap_slot {
+	lval* key;
+	lval* val;
+} lmap_slot;
+
 struct lval{
 	enum ltype {
 		LVAL_NUM,
@@ -39,40 +72,137 @@ struct lval{
 		LVAL_SYM,
 		LVAL_SEXPR,
 		LVAL_QEXPR,
-		LVAL_FUNC
+		LVAL_FUNC,
+		LVAL_BIGNUM,
+		LVAL_DOUBLE,
+		LVAL_VEC,
+		LVAL_MAP
 	} type;
 
+	int refs;  //See lval_copy()
+
 	union{
 		long num;
-		char* str;
+		double dbl;
+
+		struct{  //Bignums, see lnum.c
+			bool neg;
+			int nlimbs;
+			uint32_t* limbs;  //Least significant first, never any leading zeros
+		};
+
+		struct{  //Packed integer vectors, see lvec.c
+			long* elems;
+			int nelems;
+		};
+
+		struct{  //Hash maps, see lmap.c
+			lmap_slot* slots;  //Followed by a control byte for each slot
+			int nslots;  //0 until the first key goes in, then a power of 2
+			int nkeys;
+			int ndead;  //Slots left behind by deleted keys
+		};
+
+		struct{
+			union{
+				char* str;  //Symbols and errors
+				lstr* text;  //Strings, see lstr.c
+			};
+			unsigned long hash;  //Symbols, see LSYM, and strings once lval_str_hash() has been asked
+			int off;  //Strings only, where this one starts in text
+			int len;
+		};
 
 		struct{
 			lbuiltin builtin;
-			lenv* env;
-			lval* formals;
-			lval* body;
+			lcode* code;  //Formals, body and bytecode, shared by every copy of a lambda
+			largs* bound;  //Arguments from partial application
+			int nbound;  //How many formals bound covers
 		};
 
 		struct{
 			int count;
 			struct lval** cell;
+			int start;  //Cells lval_pop() has stepped over in front of cell
+			int max;  //Size of the whole array, including start
+			struct lval* owner;  //Set if cell points into owner's array instead, see lval_slice()
 		};
 	};
 };
 
-lval* LVAL_TRUE;
-lval* LVAL_FALSE;
+extern lval* LVAL_TRUE;
+extern lval* LVAL_FALSE;
+
+/* Numbers which fit in all but one bit of a pointer are kept in the lval*
+ * itself, shifted up with the low bit set, so they never get allocated.
+ * Anything that might be a number has to be looked at with LTYPE() and LNUM()
+ * instead of type and num.
+ */
+#define LFIXNUM(v) (((uintptr_t) (v)) & 1)
+#define LFIXNUM_MIN (LONG_MIN / 2)
+#define LFIXNUM_MAX (LONG_MAX / 2)
+#define LTYPE(v) (LFIXNUM(v) ? LVAL_NUM : (v)->type)
+#define LNUM(v) (LFIXNUM(v) ? ((long) (intptr_t) (v)) >> 1 : (v)->num)
+
+//Types arithmetic works on; a number that fits in a long is never a bignum
+#define LNUMERIC(type) ((type) == LVAL_NUM || (type) == LVAL_BIGNUM || (type) == LVAL_DOUBLE)
+
+//Types which can be the key of a map
+#define LMAP_KEY(type) (LNUMERIC(type) || (type) == LVAL_STR || (type) == LVAL_SYM)
+
+//Slices can't be changed in place even by their only user, see lval_own()
+#define LSLICE(v) (((v)->type == LVAL_SEXPR || (v)->type == LVAL_QEXPR) && (v)->owner)
+
+typedef enum rel {REL_LT, REL_GT, REL_GTE, REL_LTE, REL_EQ} rel;
+
+/* Arguments bound by partially applying a lambda
+ * Each partial application adds a node in front of the ones it was given, so
+ * lambdas made from the same partial application share everything before it.
+ */
+struct largs{
+	int refs;
+	largs* prev;  //Arguments bound before these
+	int count;
+	lval* cell[];
+};
+
+void largs_del(largs*);
+void largs_flatten(lval*, lval**);
+
+//Interned symbol names, str points at name
+typedef struct lsym{
+	unsigned long hash;  //djb2
+	unsigned long dhash;  //sdbm, for the lenv double hash
+	size_t len;  //Names may contain NULs, so this and not strlen() is the length
+	char name[];
+} lsym;
 
-//typedef enum rel {GT, LT, EQ} rel;
+#define LSYM(str) ((lsym*) ((str) - offsetof(lsym, name)))
+
+//Initial size of the intern table
+#define LSYM_INIT 256
+
+//The interned "&" used for variable arguments
+extern char* LSYM_AMP;
+
+unsigned long djb2(char*, size_t);
+void lsym_init();
+char* lsym_intern(char*);
+char* lsym_intern_n(char*, size_t);
+void lsym_cleanup();
 
 typedef struct lentry{
-	char* sym;
+	char* sym;  //Interned
 	lval* v;
 } lentry;
 
-//lenvs are hiearchal doubly hashed hashtables
+/* lenvs are hiearchal doubly hashed hashtables
+ * Local frames are flat arrays instead, filled in the order things are bound,
+ * so a lambda's formals always sit at the front in the order they're declared
+ */
 struct lenv{
 	lenv* par;
+	bool flat;
 	int max;
 	int count;
 	lentry* table;
@@ -86,47 +216,289 @@ struct lenv{
 //Use a smaller value for local scope
 #define LENV_LOCAL_INIT 8
 
+/* lvals and lenvs are allocated out of slabs of LPOOL_SLAB_CELLS cells
+ * The counters are exposed through the pool-stats builtin
+ */
+typedef struct lpool {
+	char* name;
+	size_t size;  //Size of a single cell
+	struct lslab* slabs;
+	void* free;  //Intrusive free list
+	long live;
+	long slab_count;
+	long peak;  //High-water mark of live
+	long gc_slabs;  //Mark-sweep only: collect instead of growing past this many slabs
+} lpool;
+
+#define LPOOL_SLAB_CELLS 1024
+#define LPOOL_GC_MIN_SLABS 4
+
+extern lpool lval_pool;
+extern lpool lenv_pool;
+
+void* lpool_alloc(lpool*);
+void lpool_free(lpool*, void*);
+void lpool_release(lpool*);
+void lpool_cleanup();
+lval* lpool_stats(lpool*);
+
+/* With LISP_GC=mark-sweep, lval_del() and lenv_del() do nothing and garbage is
+ * found by lpool_collect() instead. The roots are lpool_root, the lvm's value
+ * stack, and anything that looks like a pointer into a slab on the C stack
+ * between the current frame and lpool_stack_base.
+ */
+#ifdef LISP_GC_MARK_SWEEP
+#define LPOOL_SLAB_BYTES (1 << 16)  //Slabs are aligned to their size
+
+extern lenv* lpool_root;
+extern void* lpool_stack_base;
+
+//Somewhere past every local of the calling function
+#if defined(__GNUC__)
+#define LPOOL_STACK_BASE() __builtin_frame_address(0)
+#else
+#define LPOOL_STACK_BASE() ((void*) &(char){0})
+#endif
+
+void lpool_collect();
+void lpool_mark(lval*);
+lval* lpool_gc_stats();
+
+//Slabs the nursery can use before it needs a collection, see lpool_nursery_enter()
+#define LPOOL_NURSERY_SLABS 16
+
+bool lpool_young(void*);
+void* lpool_alloc_young(bool);
+void lpool_nursery_enter();
+void lpool_nursery_leave();
+lval* lpool_nursery_stats();
+lval* lval_promote(lval*);
+#else
+//Reference counting frees temporaries as soon as they die, so there's no nursery
+#define lpool_nursery_enter()
+#define lpool_nursery_leave()
+#define lval_promote(v) (v)
+#endif
+
+//Bytecode for the lvm, see lvm.c for what each op does
+typedef enum lop {
+	LOP_CONST,  //const: push a copy of a constant
+	LOP_LOCAL,  //const, slot: push the value of one of the formals
+	LOP_GLOBAL,  //const: push the value of a symbol from any scope
+	LOP_SEXPR,  //push an empty sexpr
+	LOP_CALL,  //n: apply the function below the top n values
+	LOP_TAILCALL,  //n: same, but hand the call back to lval_eval()
+	LOP_EVAL,  //evaluate the top of the stack
+	LOP_TAILEVAL,  //same, but hand it back to lval_eval()
+	LOP_IF,  //target: pop builtin if off the stack or jump to target
+	LOP_JUMP_IF,  //target, const, const: pop a boolean and jump if it is false
+	LOP_JUMP,  //target
+	LOP_RETURN  //return the top of the stack
+} lop;
+
+//What lvm_run() handed back
+typedef enum lvm_result {LVM_VALUE, LVM_EVAL, LVM_APPLY} lvm_result;
+
+//A lambda's formals and body, and the body once it has been compiled
+struct lcode{
+	int refs;
+	bool compiled;
+
+	lval* formals;
+	lval* body;
+
+	int nformals;
+	char** locals;  //Interned names of the formals, in slot order
+
+	int count;
+	int* ops;
+	int nconsts;
+	lval** consts;
+
+	int sp;  //Stack depth while compiling
+	int depth;  //Maximum stack depth
+};
+
+extern bool lvm_enabled;
+
+lcode* lcode_new(lval*, lval*);
+void lcode_del(lcode*);
+void lvm_compile(lcode*);
+lval* lvm_run(lcode*, lenv*, lvm_result*);
+#ifdef LISP_GC_MARK_SWEEP
+void lvm_mark();
+#endif
+
+//Slices shorter than this are just copied
+#define LVAL_SLICE_MIN 16
+
 //enum { LERR_DIV_0, LERR_BAD_OP, LERR_BAD_NUM};
 
 #define LVAL_ERR_MAX 512
 
+//A source of top-level forms, see lread.c
+typedef struct lstream lstream;
+
 lval* parse(char*, lenv*);
 lval* nparse(char*, size_t, lenv*);
-lenv* init();
+lval* load(lenv*, lstream*);
+lenv* init(char*);
 
 lval* lval_num(long);
+lval* lval_bignum(bool, int, uint32_t*);
+lval* lval_double(double);
+lval* lval_vec(int, long*);
+lval* lval_map();
 lval* lval_bool(int);
 lval* lval_err(char*, ...);
 lval* lval_str(char*);
+lval* lval_str_n(char*, size_t);
+lval* lval_text(lstr*, int, int);
 lval* lval_sym(char*);
+lval* lval_sym_n(char*, size_t);
 lval* lval_sexp();
 lval* lval_qexpr();
 lval* lval_func(lbuiltin);
 lval* lval_lambda(lval*, lval*);
+lval* lval_partial(lval*, lval*, int);
 lval* lval_bool(int);
 
 void lval_del(lval*);
+void lval_clear(lval*);
+void lval_reserve(lval*, int);
 lval* lval_append(lval*, lval*);
 lval* lval_join(lval*, lval*);
 lval* lval_copy(lval*);
+lval* lval_own(lval*);
 lval* lval_take(lval*, int);
+lval* lval_slice(lval*, int, int);
 lval* lval_pop(lval*, int);
 lval* lval_equals(lval*, lval*);
 //rel lval_compare(lval*, lval*);
 
-void lval_print(lval*);
-void lval_expr_print(lval*, char, char);
-void lval_str_print(lval*);
-void lval_println(lval*);
+/* Printing goes into an lbuf, which is written out LBUF_SIZE bytes at a time
+ * An lbuf with an fd of -1 is never written out and just grows instead
+ */
+typedef struct lbuf {
+	int fd;
+	char* data;
+	size_t len;
+	size_t max;
+} lbuf;
+
+#define LBUF_SIZE (1 << 16)
+
+//stdout, flushed by the REPL, before reading from stdin, and at exit
+extern lbuf lbuf_out;
+
+bool lbuf_flush(lbuf*);
+void lbuf_flush_out();
+void lbuf_write(lbuf*, char*, size_t);
+void lbuf_putc(lbuf*, char);
+void lbuf_puts(lbuf*, char*);
+void lbuf_num(lbuf*, long);
+
+void lval_print(lbuf*, lval*);
+void lval_expr_print(lbuf*, lval*, char, char);
+void lval_str_print(lbuf*, lval*);
+void lval_println(lbuf*, lval*);
+
+lval* lread(char*, char*, size_t);
+lstream* lstream_new(char*, FILE*);
+lstream* lstream_open(char*);
+lstream* lstream_mem(char*, char*, size_t);
+void lstream_del(lstream*);
+lval* lstream_err(lstream*);
+lval* lread_next(lstream*);
+
+//Arithmetic on bignums and doubles, see lnum.c
+typedef enum arith {ARITH_ADD, ARITH_SUB, ARITH_MUL, ARITH_DIV, ARITH_MOD, ARITH_POW, ARITH_MIN, ARITH_MAX} arith;
+
+//Multiply bignums at least this many limbs long with Karatsuba's algorithm
+#define LNUM_KARATSUBA 32
+//Refuse to make bignums bigger than this many limbs
+#define LNUM_MAX_LIMBS (1 << 24)
+
+#ifndef __GNUC__
+//Stand-ins for the gcc/clang builtins; only ever used on longs
+static inline bool long_mul_overflow(long x, long y, long* r) {
+
+	if(x && y) {
+		if(x > 0 ? (y > 0 ? x > LONG_MAX / y : y < LONG_MIN / x)
+		         : (y > 0 ? x < LONG_MIN / y : x < LONG_MAX / y))
+			return true;
+	}
+	*r = x * y;
+	return false;
+
+}
+#define __builtin_add_overflow(x, y, r) (((y) > 0 ? (x) > LONG_MAX - (y) : (x) < LONG_MIN - (y)) || (*(r) = (x) + (y), false))
+#define __builtin_sub_overflow(x, y, r) (((y) < 0 ? (x) > LONG_MAX + (y) : (x) < LONG_MIN + (y)) || (*(r) = (x) - (y), false))
+#define __builtin_mul_overflow(x, y, r) long_mul_overflow((x), (y), (r))
+#endif
+
+lval* lnum_arith(arith, lval*, lval*);
+int lnum_compare(lval*, lval*);
+lval* lnum_read(char*, size_t, bool);
+void lnum_print(lbuf*, lval*);
+
+//Packed integer vectors, see lvec.c
+void lvec_init(bool);
+long* lvec_alloc(int);
+lval* lvec_fold(arith, lval*);
+lval* lvec_dot(lval*, lval*);
+lval* lvec_map(arith, lval*, lval*);
+lval* lvec_compare(rel, lval*, lval*);
+
+//Strings, see lstr.c
+
+//Concatenations shorter than this are copied instead of making a rope
+#define LSTR_ROPE_MIN 64
+
+lstr* lstr_new(char*, int);
+void lstr_del(lstr*);
+char* lval_str_chars(lval*);
+char* lval_str_cstr(lval*);
+unsigned long lval_str_hash(lval*);
+lval* lval_str_cat(lval*, lval*);
+lval* lval_substr(lval*, int, int);
+int lval_str_find(lval*, lval*, int);
+
+//Hash maps, see lmap.c
+
+//Slots are looked at this many at a time, and a map always has a multiple of it
+#define LMAP_GROUP 16
+
+//The control bytes after the slots, and whether slot i holds a key
+#define LMAP_CTRL(m) ((signed char*) ((m)->slots + (m)->nslots))
+#define LMAP_FULL(m, i) (LMAP_CTRL(m)[i] >= 0)
+
+lval* lmap_get(lval*, lval*);
+lval* lmap_put(lval*, lval*, lval*);
+lval* lmap_del(lval*, lval*);
+void lmap_clone(lval*, lval*, lval*(*)(lval*));
+
+//Binary lvals and images, see lser.c
+typedef struct lser lser;
+
+#define LSER_VERSION 1
 
-lval* lval_read(mpc_ast_t*);
-lval* lval_read_num(mpc_ast_t*);
-lval* lval_read_str(mpc_ast_t*);
+lser* lser_writer(FILE*);
+lser* lser_reader(FILE*);
+lser* lser_mem(unsigned char*, size_t);
+bool lser_flush(lser*);
+void lser_del(lser*);
+void lser_write(lser*, lval*);
+lval* lser_read(lser*);
+char* lser_save_env(lenv*, FILE*);
+lval* lser_load_env(lenv*, lser*);
+char* lser_save(lval*, FILE*);
+lval* lser_load(FILE*);
 
 lval* lval_eval(lenv*, lval*);
-lval* lval_eval_sexpr(lenv*, lval*);
+lval* lval_apply(lenv*, lval*);
 
-lval* lval_call(lenv*, lval*, lval*);
+lval* lval_call(lval*, lval*, lenv**);
 
 char* ltype_name(enum ltype);
 
@@ -134,29 +506,62 @@ lval* builtin_head(lenv*, lval*);
 lval* builtin_tail(lenv*, lval*);
 lval* builtin_list(lenv*, lval*);
 lval* builtin_eval(lenv*, lval*);
+lval* builtin_if(lenv*, lval*);
 lval* builtin_join(lenv*, lval*);
+lval* builtin_len(lenv*, lval*);
+lval* builtin_nth(lenv*, lval*);
+lval* builtin_last(lenv*, lval*);
+lval* builtin_take(lenv*, lval*);
+lval* builtin_drop(lenv*, lval*);
+lval* builtin_elem(lenv*, lval*);
+lval* builtin_map(lenv*, lval*);
+lval* builtin_filter(lenv*, lval*);
+lval* builtin_foldl(lenv*, lval*);
+lval* builtin_range(lenv*, lval*);
+lval* builtin_vec(lenv*, lval*);
+lval* builtin_vec_list(lenv*, lval*);
+lval* builtin_str_len(lenv*, lval*);
+lval* builtin_str_cat(lenv*, lval*);
+lval* builtin_substr(lenv*, lval*);
+lval* builtin_str_find(lenv*, lval*);
+lval* builtin_str_split(lenv*, lval*);
+lval* builtin_map_new(lenv*, lval*);
+lval* builtin_map_get(lenv*, lval*);
+lval* builtin_map_put(lenv*, lval*);
+lval* builtin_map_del(lenv*, lval*);
+lval* builtin_map_keys(lenv*, lval*);
+lval* builtin_map_size(lenv*, lval*);
 lval* builtin_lambda(lenv*, lval*);
 lval* builtin_def(lenv*, lval*);
 lval* builtin_put(lenv*, lval*);
-lval* builtin_op(lenv*, lval*, char*);
 lval* builtin_eq(lenv*, lval*);
 lval* builtin_load(lenv*, lval*);
+lval* builtin_save_image(lenv*, lval*);
+lval* builtin_serialize(lenv*, lval*);
+lval* builtin_deserialize(lenv*, lval*);
 lval* builtin_print(lenv*, lval*);
+lval* builtin_to_string(lenv*, lval*);
 lval* builtin_err(lenv*, lval*);
 lval* builtin_exit(lenv*, lval*);
+lval* builtin_pool_stats(lenv*, lval*);
 //lval* builtin(lval*, char*);
 
 lenv* lenv_new(int);
+lenv* lenv_frame(int);
 void lenv_del(lenv*);
+void lenv_clear(lenv*);
 lenv* lenv_copy(lenv*);
 void lenv_put(lenv*, lval*, lval*);
+void lenv_bind(lenv*, lval*, lval*);
 void lenv_def(lenv*, lval*, lval*);
 lval* lenv_get(lenv*, lval*);
+void lenv_absorb(lenv*, lenv*);
 void lenv_add_builtin(lenv*, char*, lbuiltin);
+char* lbuiltin_name(lbuiltin);
+lbuiltin lbuiltin_find(char*);
 void lenv_add_builtins(lenv*);
 lval* lenv_equals(lenv*, lenv*);
 
-//lval eval(mpc_ast_t*);
 //lval eval_op(char*, lval, lval);
 //lval divide(long, long);
 
@@ -0,0 +1,262 @@
+/**
+ * lisp-forty, a lisp interpreter
+ * Copyright (C) 2014-16 Sean Anderson
+ *
+ * This file is part of lisp-forty.
+ *
+ * lisp-forty is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lisp-forty.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "lisp.h"
+
+/* Hash maps
+ * Maps are open-addressed tables in the style of Abseil's Swiss tables. Each
+ * slot has a control byte saying whether it's empty, was deleted, or is full,
+ * and a full slot's byte also holds 7 bits of its key's hash. Slots are looked
+ * at LMAP_GROUP at a time, so one SSE2 compare finds every slot in the group
+ * which might hold the key, and the key is only compared for those. Groups are
+ * probed triangularly, which visits every one of them, until one has an empty
+ * slot in it.
+ * Like every other lval, a map is never changed once it's shared, so the
+ * builtins lval_own() one before handing it to lmap_put() or lmap_del().
+ */
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define LMAP_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef __GNUC__
+static inline int lmap_ctz(uint32_t x) {
+
+	int n = 0;
+	for(; !(x & 1); x >>= 1) n++;
+	return n;
+
+}
+#define __builtin_ctz(x) lmap_ctz(x)
+#endif
+
+#define LMAP_EMPTY ((signed char) -128)
+#define LMAP_DELETED ((signed char) -2)
+
+#define LMAP_H1(hash) ((hash) >> 7)  //Picks the first group to look in
+#define LMAP_H2(hash) ((signed char) ((hash) & 0x7f))  //Kept in the control byte
+
+//A bit for each slot in the group whose control byte is c
+static inline uint32_t lmap_match(signed char* group, signed char c) {
+
+#ifdef LMAP_SSE2
+	__m128i g = _mm_loadu_si128((__m128i*) group);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+	uint32_t match = 0;
+	for(int i = 0; i < LMAP_GROUP; i++)
+		if(group[i] == c) match |= 1u << i;
+	return match;
+#endif
+
+}
+
+//A bit for each slot in the group which is empty or deleted, which are the only bytes with the top bit set
+static inline uint32_t lmap_match_free(signed char* group) {
+
+#ifdef LMAP_SSE2
+	return _mm_movemask_epi8(_mm_loadu_si128((__m128i*) group));
+#else
+	uint32_t match = 0;
+	for(int i = 0; i < LMAP_GROUP; i++)
+		if(group[i] < 0) match |= 1u << i;
+	return match;
+#endif
+
+}
+
+static uint64_t lmap_hash(lval* key) {
+
+	uint64_t h = 0;
+	switch(LTYPE(key)) {
+		case(LVAL_NUM): h = (uint64_t) LNUM(key); break;
+		case(LVAL_BIGNUM): h = djb2((char*) key->limbs, sizeof(uint32_t) * key->nlimbs) ^ key->neg; break;
+		case(LVAL_DOUBLE): {
+			double d = key->dbl == 0 ? 0 : key->dbl;  //-0.0 == 0.0
+			memcpy(&h, &d, sizeof(d));
+			break;
+		}
+		case(LVAL_STR): h = lval_str_hash(key); break;
+		case(LVAL_SYM): h = key->hash; break;
+		default: break;
+	}
+
+	//MurmurHash3's finalizer, so every bit of the key has a say in both H1 and H2
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+
+}
+
+//The slot holding key, or -1
+static int lmap_find(lval* m, lval* key, uint64_t hash) {
+
+	if(!m->nslots) return -1;
+
+	signed char* ctrl = LMAP_CTRL(m);
+	int groups = m->nslots / LMAP_GROUP - 1;
+	int g = (int) (LMAP_H1(hash) & groups);
+	for(int step = 1;; step++) {
+		signed char* group = ctrl + g * LMAP_GROUP;
+		for(uint32_t match = lmap_match(group, LMAP_H2(hash)); match; match &= match - 1) {
+			int i = g * LMAP_GROUP + __builtin_ctz(match);
+			if(lval_equals(m->slots[i].key, key) == LVAL_TRUE) return i;
+		}
+		if(lmap_match(group, LMAP_EMPTY)) return -1;
+		g = (g + step) & groups;
+	}
+
+}
+
+//The first empty or deleted slot a key with hash could go in
+static int lmap_free_slot(lval* m, uint64_t hash) {
+
+	signed char* ctrl = LMAP_CTRL(m);
+	int groups = m->nslots / LMAP_GROUP - 1;
+	int g = (int) (LMAP_H1(hash) & groups);
+	for(int step = 1;; step++) {
+		uint32_t match = lmap_match_free(ctrl + g * LMAP_GROUP);
+		if(match) return g * LMAP_GROUP + __builtin_ctz(match);
+		g = (g + step) & groups;
+	}
+
+}
+
+/* Move everything into a new table, which is at most 7/16 full
+ * It's only bigger than the old one if the keys need the room, so a map which
+ * has filled up with deleted slots stays the same size.
+ */
+static void lmap_rehash(lval* m, int nkeys) {
+
+	int nslots = m->nslots ? m->nslots : LMAP_GROUP;
+	while(nkeys * 16 > nslots * 7) nslots *= 2;
+
+	lmap_slot* old = m->slots;
+	signed char* ctrl = LMAP_CTRL(m);
+	int nold = m->nslots;
+
+	m->slots = malloc((sizeof(lmap_slot) + 1) * nslots);
+	m->nslots = nslots;
+	m->ndead = 0;
+	memset(LMAP_CTRL(m), LMAP_EMPTY, nslots);
+
+	for(int i = 0; i < nold; i++) {
+		if(ctrl[i] < 0) continue;
+		int j = lmap_free_slot(m, lmap_hash(old[i].key));
+		LMAP_CTRL(m)[j] = ctrl[i];
+		m->slots[j] = old[i];
+	}
+	free(old);
+
+}
+
+//The value key maps to in m, or NULL; the caller doesn't get a reference to it
+lval* lmap_get(lval* m, lval* key) {
+
+	int i = lmap_find(m, key, lmap_hash(key));
+	return i < 0 ? NULL : m->slots[i].val;
+
+}
+
+//Map key to val in m, which must be owned by the caller, consuming key and val
+lval* lmap_put(lval* m, lval* key, lval* val) {
+
+	uint64_t hash = lmap_hash(key);
+	int i = lmap_find(m, key, hash);
+	if(i >= 0) {
+		lval_del(key);
+		lval_del(m->slots[i].val);
+		m->slots[i].val = val;
+		return m;
+	}
+
+	if((m->nkeys + m->ndead + 1) * 8 > m->nslots * 7) lmap_rehash(m, m->nkeys + 1);  //Keep an empty slot in reach of every probe
+	i = lmap_free_slot(m, hash);
+	signed char* ctrl = LMAP_CTRL(m);
+	if(ctrl[i] == LMAP_DELETED) m->ndead--;
+	ctrl[i] = LMAP_H2(hash);
+	m->slots[i].key = key;
+	m->slots[i].val = val;
+	m->nkeys++;
+	return m;
+
+}
+
+//Remove key from m, which must be owned by the caller
+lval* lmap_del(lval* m, lval* key) {
+
+	int i = lmap_find(m, key, lmap_hash(key));
+	if(i < 0) return m;
+
+	lval_del(m->slots[i].key);
+	lval_del(m->slots[i].val);
+	m->nkeys--;
+
+	//No probe has ever gone on past a group with an empty slot in it, so this slot can be empty too
+	signed char* ctrl = LMAP_CTRL(m);
+	if(lmap_match(ctrl + (i & ~(LMAP_GROUP - 1)), LMAP_EMPTY)) {
+		ctrl[i] = LMAP_EMPTY;
+	} else {
+		ctrl[i] = LMAP_DELETED;
+		m->ndead++;
+	}
+	return m;
+
+}
+
+/* Make x a map with the same keys as v, passing every key and value through f
+ * This is also how lval_promote() copies a map, so x is kept in a state the
+ * collector can trace the whole time: a slot only gets marked full once its
+ * key and value are both in it.
+ */
+void lmap_clone(lval* x, lval* v, lval* (*f)(lval*)) {
+
+	x->slots = NULL;
+	x->nslots = 0;
+	x->nkeys = 0;
+	x->ndead = v->ndead;
+	if(!v->nslots) return;
+
+	lmap_slot* slots = malloc((sizeof(lmap_slot) + 1) * v->nslots);
+	memset(slots + v->nslots, LMAP_EMPTY, v->nslots);
+	x->slots = slots;
+	x->nslots = v->nslots;
+
+	signed char* from = LMAP_CTRL(v);
+	signed char* to = LMAP_CTRL(x);
+	for(int i = 0; i < v->nslots; i++) {
+		if(from[i] < 0) {
+			to[i] = from[i];  //Deleted slots have to stay, or probes would stop short
+			continue;
+		}
+		lval* key = f(v->slots[i].key);
+		lval* val = f(v->slots[i].val);
+		x->slots[i].key = key;
+		x->slots[i].val = val;
+		to[i] = from[i];
+		x->nkeys++;
+	}
+
+}
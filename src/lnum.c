@@ -0,0 +1,562 @@
+/**
+ * lisp-forty, a lisp interpreter
+ * Copyright (C) 2014-16 Sean Anderson
+ *
+ * This file is part of lisp-forty.
+ *
+ * lisp-forty is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lisp-forty.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <float.h>
+
+#include "lisp.h"
+
+/* Numbers that don't fit in a long
+ * builtin_op() does arithmetic on longs until something overflows, and only
+ * then comes here. Integers which need more than a long are bignums: a sign
+ * and a magnitude made of 32-bit limbs, least significant first. Arithmetic
+ * involving a double is done in doubles, but comparisons are exact.
+ */
+
+typedef uint32_t limb;
+typedef uint64_t dlimb;
+
+#define LIMB_BITS 32
+#define LIMB_BASE ((dlimb) 1 << LIMB_BITS)
+
+//Limbs needed to hold an unsigned long
+#define LONG_LIMBS ((int) ((sizeof(unsigned long) + sizeof(limb) - 1) / sizeof(limb)))
+//Limbs needed to hold the integer part of any double
+#define DOUBLE_LIMBS ((DBL_MAX_EXP + LIMB_BITS - 1) / LIMB_BITS)
+
+//A bignum or a long, looked at as a sign and magnitude
+typedef struct lbig {
+	bool neg;
+	int size;
+	limb* d;
+} lbig;
+
+//buf holds the limbs of plain numbers, and needs to be LONG_LIMBS long
+static lbig lbig_of(lval* v, limb* buf) {
+
+	lbig b = {false, 0, buf};
+	if(LTYPE(v) == LVAL_BIGNUM) {
+		b.neg = v->neg;
+		b.size = v->nlimbs;
+		b.d = v->limbs;
+		return b;
+	}
+
+	long n = LNUM(v);
+	unsigned long u = n < 0 ? 0 - (unsigned long) n : (unsigned long) n;
+	b.neg = n < 0;
+	for(; u; u = u >> 16 >> 16)
+		buf[b.size++] = (limb) u;
+	return b;
+
+}
+
+/* Magnitudes */
+
+static int mag_cmp(limb* a, int na, limb* b, int nb) {
+
+	if(na != nb) return na < nb ? -1 : 1;
+	for(int i = na - 1; i >= 0; i--)
+		if(a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+	return 0;
+
+}
+
+//out = a + b, where out has room for max(na, nb) + 1 limbs
+static int mag_add(limb* a, int na, limb* b, int nb, limb* out) {
+
+	if(na < nb) return mag_add(b, nb, a, na, out);
+
+	dlimb carry = 0;
+	int i;
+	for(i = 0; i < nb; i++) {
+		carry += (dlimb) a[i] + b[i];
+		out[i] = (limb) carry;
+		carry >>= LIMB_BITS;
+	}
+	for(; i < na; i++) {
+		carry += a[i];
+		out[i] = (limb) carry;
+		carry >>= LIMB_BITS;
+	}
+	out[na] = (limb) carry;
+	return na + 1;
+
+}
+
+//out = a - b, where a >= b and out has room for na limbs; out can be a
+static void mag_sub(limb* a, int na, limb* b, int nb, limb* out) {
+
+	limb borrow = 0;
+	for(int i = 0; i < na; i++) {
+		dlimb y = (dlimb) (i < nb ? b[i] : 0) + borrow;
+		borrow = a[i] < y;
+		out[i] = (limb) ((dlimb) a[i] - y);
+	}
+
+}
+
+//Add x into the n limbs at out
+static void mag_add_at(limb* out, int n, limb* x, int nx) {
+
+	while(nx && !x[nx - 1]) nx--;
+
+	dlimb carry = 0;
+	int i;
+	for(i = 0; i < nx; i++) {
+		carry += (dlimb) out[i] + x[i];
+		out[i] = (limb) carry;
+		carry >>= LIMB_BITS;
+	}
+	for(; carry && i < n; i++) {
+		carry += out[i];
+		out[i] = (limb) carry;
+		carry >>= LIMB_BITS;
+	}
+
+}
+
+//out = a * b, filling all na + nb limbs of out
+static void mag_mul(limb* a, int na, limb* b, int nb, limb* out) {
+
+	if(na < nb) {
+		mag_mul(b, nb, a, na, out);
+		return;
+	}
+
+	if(nb < LNUM_KARATSUBA) {
+		memset(out, 0, sizeof(limb) * (na + nb));
+		for(int i = 0; i < nb; i++) {
+			dlimb carry = 0;
+			for(int j = 0; j < na; j++) {
+				carry += (dlimb) b[i] * a[j] + out[i + j];
+				out[i + j] = (limb) carry;
+				carry >>= LIMB_BITS;
+			}
+			out[i + na] = (limb) carry;
+		}
+		return;
+	}
+
+	//Karatsuba wants halves of about the same size, so cut a long a into pieces as long as b
+	if(na >= 2 * nb) {
+		memset(out, 0, sizeof(limb) * (na + nb));
+		limb* part = malloc(sizeof(limb) * 2 * nb);
+		for(int i = 0; i < na; i += nb) {
+			int k = na - i < nb ? na - i : nb;
+			mag_mul(a + i, k, b, nb, part);
+			mag_add_at(out + i, na + nb - i, part, k + nb);
+		}
+		free(part);
+		return;
+	}
+
+	/* With a = a1 * B^h + a0 and b = b1 * B^h + b0,
+	 * a * b = z2 * B^2h + (z1 - z2 - z0) * B^h + z0
+	 * where z2 = a1 * b1, z0 = a0 * b0 and z1 = (a1 + a0) * (b1 + b0)
+	 */
+	int h = (na + 1) / 2;
+	mag_mul(a, h, b, h, out);  //z0
+	mag_mul(a + h, na - h, b + h, nb - h, out + 2 * h);  //z2
+
+	limb* sa = malloc(sizeof(limb) * (h + 1));
+	limb* sb = malloc(sizeof(limb) * (h + 1));
+	limb* z1 = malloc(sizeof(limb) * (2 * h + 2));
+	mag_add(a, h, a + h, na - h, sa);
+	mag_add(b, h, b + h, nb - h, sb);
+	mag_mul(sa, h + 1, sb, h + 1, z1);
+	mag_sub(z1, 2 * h + 2, out, 2 * h, z1);
+	mag_sub(z1, 2 * h + 2, out + 2 * h, na + nb - 2 * h, z1);
+	mag_add_at(out + h, na + nb - h, z1, 2 * h + 2);
+
+	free(sa);
+	free(sb);
+	free(z1);
+
+}
+
+/* q = u / v and r = u % v, where u has m >= n limbs, v has n limbs and no
+ * leading zero, q has room for m - n + 1 limbs and r for n
+ * This is Knuth's algorithm D.
+ */
+static void mag_divmod(limb* u, int m, limb* v, int n, limb* q, limb* r) {
+
+	if(n == 1) {
+		dlimb k = 0;
+		for(int j = m - 1; j >= 0; j--) {
+			k = (k << LIMB_BITS) | u[j];
+			q[j] = (limb) (k / v[0]);
+			k %= v[0];
+		}
+		r[0] = (limb) k;
+		return;
+	}
+
+	//Shift so the top limb of v has its high bit set, which makes qhat at most 2 too big
+	int s = 0;
+	while(!((v[n - 1] << s) & ((limb) 1 << (LIMB_BITS - 1)))) s++;
+
+	limb* vn = malloc(sizeof(limb) * n);
+	limb* un = malloc(sizeof(limb) * (m + 1));
+	for(int i = n - 1; i > 0; i--)
+		vn[i] = (v[i] << s) | (s ? v[i - 1] >> (LIMB_BITS - s) : 0);
+	vn[0] = v[0] << s;
+	un[m] = s ? u[m - 1] >> (LIMB_BITS - s) : 0;
+	for(int i = m - 1; i > 0; i--)
+		un[i] = (u[i] << s) | (s ? u[i - 1] >> (LIMB_BITS - s) : 0);
+	un[0] = u[0] << s;
+
+	for(int j = m - n; j >= 0; j--) {
+		dlimb top = ((dlimb) un[j + n] << LIMB_BITS) | un[j + n - 1];
+		dlimb qhat = top / vn[n - 1];
+		dlimb rhat = top % vn[n - 1];
+		while(qhat >= LIMB_BASE || qhat * vn[n - 2] > ((rhat << LIMB_BITS) | un[j + n - 2])) {
+			qhat--;
+			rhat += vn[n - 1];
+			if(rhat >= LIMB_BASE) break;
+		}
+
+		//un -= qhat * vn, shifted up j limbs
+		int64_t borrow = 0;
+		int64_t t;
+		for(int i = 0; i < n; i++) {
+			dlimb p = qhat * vn[i];
+			t = (int64_t) un[i + j] - borrow - (int64_t) (p & (LIMB_BASE - 1));
+			un[i + j] = (limb) t;
+			borrow = (int64_t) (p >> LIMB_BITS) - (t >> LIMB_BITS);
+		}
+		t = (int64_t) un[j + n] - borrow;
+		un[j + n] = (limb) t;
+
+		q[j] = (limb) qhat;
+		if(t < 0) {  //qhat was one too big, so add vn back
+			q[j]--;
+			dlimb carry = 0;
+			for(int i = 0; i < n; i++) {
+				carry += (dlimb) un[i + j] + vn[i];
+				un[i + j] = (limb) carry;
+				carry >>= LIMB_BITS;
+			}
+			un[j + n] += (limb) carry;
+		}
+	}
+
+	for(int i = 0; i < n; i++)
+		r[i] = (un[i] >> s) | (s ? un[i + 1] << (LIMB_BITS - s) : 0);
+	free(vn);
+	free(un);
+
+}
+
+/* Integers */
+
+static limb* lbig_dup(lbig x) {
+
+	limb* d = malloc(sizeof(limb) * x.size);
+	memcpy(d, x.d, sizeof(limb) * x.size);
+	return d;
+
+}
+
+static lval* lbig_add(lbig x, lbig y) {
+
+	if(x.neg == y.neg) {
+		limb* out = malloc(sizeof(limb) * ((x.size > y.size ? x.size : y.size) + 1));
+		int n = mag_add(x.d, x.size, y.d, y.size, out);
+		return lval_bignum(x.neg, n, out);
+	}
+
+	if(mag_cmp(x.d, x.size, y.d, y.size) < 0) {
+		lbig t = x;
+		x = y;
+		y = t;
+	}
+	limb* out = malloc(sizeof(limb) * x.size);
+	mag_sub(x.d, x.size, y.d, y.size, out);
+	return lval_bignum(x.neg, x.size, out);
+
+}
+
+static lval* lbig_mul(lbig x, lbig y) {
+
+	if(!x.size || !y.size) return lval_num(0);
+	if(x.size + y.size > LNUM_MAX_LIMBS) return lval_err("Number too large");
+
+	limb* out = malloc(sizeof(limb) * (x.size + y.size));
+	mag_mul(x.d, x.size, y.d, y.size, out);
+	return lval_bignum(x.neg != y.neg, x.size + y.size, out);
+
+}
+
+//Division rounds towards zero, and remainders take the sign of x, just like C
+static lval* lbig_divmod(lbig x, lbig y, bool mod) {
+
+	if(!y.size) return lval_err("Division by zero");
+	if(mag_cmp(x.d, x.size, y.d, y.size) < 0)
+		return mod ? lval_bignum(x.neg, x.size, lbig_dup(x)) : lval_num(0);
+
+	limb* q = malloc(sizeof(limb) * (x.size - y.size + 1));
+	limb* r = malloc(sizeof(limb) * y.size);
+	mag_divmod(x.d, x.size, y.d, y.size, q, r);
+	if(mod) {
+		free(q);
+		return lval_bignum(x.neg, y.size, r);
+	}
+	free(r);
+	return lval_bignum(x.neg != y.neg, x.size - y.size + 1, q);
+
+}
+
+static lval* lbig_pow(lbig x, lval* y) {
+
+	bool odd = LTYPE(y) == LVAL_BIGNUM ? y->limbs[0] & 1 : LNUM(y) & 1;
+	bool negative = LTYPE(y) == LVAL_BIGNUM ? y->neg : LNUM(y) < 0;
+
+	//Only 1 and -1 are worth raising to a big or negative power
+	if(x.size == 1 && x.d[0] == 1) return lval_num(x.neg && odd ? -1 : 1);
+	if(negative) return x.size ? lval_num(0) : lval_err("Division by zero");
+	if(!x.size) return lval_num(LTYPE(y) == LVAL_NUM && LNUM(y) == 0);
+	if(LTYPE(y) == LVAL_BIGNUM || (double) LNUM(y) * x.size > LNUM_MAX_LIMBS) return lval_err("Number too large");
+
+	lval* result = lval_num(1);
+	lval* base = lval_bignum(false, x.size, lbig_dup(x));
+	for(long n = LNUM(y); n; n >>= 1) {
+		limb rb[LONG_LIMBS], bb[LONG_LIMBS];
+		if(n & 1) {
+			lval* r = lbig_mul(lbig_of(result, rb), lbig_of(base, bb));
+			lval_del(result);
+			result = r;
+		}
+		if(n > 1) {
+			lval* b = lbig_mul(lbig_of(base, bb), lbig_of(base, bb));
+			lval_del(base);
+			base = b;
+		}
+	}
+	lval_del(base);
+
+	if(x.neg && odd) {
+		lval* r = lnum_arith(ARITH_SUB, lval_num(0), result);
+		lval_del(result);
+		result = r;
+	}
+	return result;
+
+}
+
+/* Doubles */
+
+static double lnum_double(lval* v) {
+
+	if(LTYPE(v) == LVAL_DOUBLE) return v->dbl;
+	if(LTYPE(v) == LVAL_NUM) return (double) LNUM(v);
+
+	double d = 0;
+	for(int i = v->nlimbs - 1; i >= 0; i--)
+		d = d * (double) LIMB_BASE + v->limbs[i];
+	return v->neg ? -d : d;
+
+}
+
+/* Doubles are always finite, so there's no inf or nan to print or read back
+ * Anything that would make one is an error instead, like it is for integers.
+ */
+static lval* lnum_double_result(double d) {
+
+	if(isnan(d)) return lval_err("Result is not a number");
+	if(isinf(d)) return lval_err("Number too large");
+	return lval_double(d);
+
+}
+
+static lval* lnum_double_arith(arith op, double x, double y) {
+
+	switch(op) {
+		case(ARITH_ADD): return lnum_double_result(x + y);
+		case(ARITH_SUB): return lnum_double_result(x - y);
+		case(ARITH_MUL): return lnum_double_result(x * y);
+		case(ARITH_DIV):
+			if(y == 0) return lval_err("Division by zero");
+			return lnum_double_result(x / y);
+		case(ARITH_MOD):
+			if(y == 0) return lval_err("Division by zero");
+			return lnum_double_result(fmod(x, y));
+		case(ARITH_POW): return lnum_double_result(pow(x, y));
+		default: return lval_err("Not an arithmetic function!");
+	}
+
+}
+
+/* x op y, for any two numbers
+ * Neither x nor y is used up. min and max hand back whichever one they picked.
+ */
+lval* lnum_arith(arith op, lval* x, lval* y) {
+
+	if(op == ARITH_MIN || op == ARITH_MAX) {
+		int c = lnum_compare(x, y);
+		return lval_copy((op == ARITH_MIN ? c <= 0 : c >= 0) ? x : y);
+	}
+
+	if(LTYPE(x) == LVAL_DOUBLE || LTYPE(y) == LVAL_DOUBLE)
+		return lnum_double_arith(op, lnum_double(x), lnum_double(y));
+
+	limb xb[LONG_LIMBS], yb[LONG_LIMBS];
+	lbig a = lbig_of(x, xb);
+	lbig b = lbig_of(y, yb);
+	switch(op) {
+		case(ARITH_SUB): b.neg = !b.neg;  //Fall through
+		case(ARITH_ADD): return lbig_add(a, b);
+		case(ARITH_MUL): return lbig_mul(a, b);
+		case(ARITH_DIV): return lbig_divmod(a, b, false);
+		case(ARITH_MOD): return lbig_divmod(a, b, true);
+		case(ARITH_POW): return lbig_pow(a, y);
+		default: return lval_err("Not an arithmetic function!");
+	}
+
+}
+
+static int lbig_cmp(lbig a, lbig b) {
+
+	if(a.neg != b.neg) return a.neg ? -1 : 1;
+	int c = mag_cmp(a.d, a.size, b.d, b.size);
+	return a.neg ? -c : c;
+
+}
+
+/* Compare the integer a with the double d exactly
+ * Turning a into a double would round away everything past 2^53, so instead the
+ * floor of d, which is an integer since doubles are always finite, becomes
+ * limbs. Peeling off a limb at a time with powers of 2 is exact.
+ */
+static int lnum_compare_double(lbig a, double d) {
+
+	double whole = floor(d);
+	double m = fabs(whole);
+	int exp;
+	frexp(m, &exp);  //m < 2^exp
+
+	limb buf[DOUBLE_LIMBS];
+	lbig b = {whole < 0, (exp + LIMB_BITS - 1) / LIMB_BITS, buf};
+	for(int i = b.size - 1; i >= 0; i--) {
+		double scale = ldexp(1, LIMB_BITS * i);
+		buf[i] = (limb) (m / scale);
+		m -= buf[i] * scale;
+	}
+
+	int c = lbig_cmp(a, b);
+	if(c == 0 && whole != d) return -1;  //a is the floor of d, which is smaller
+	return c;
+
+}
+
+//Returns less than, equal to, or greater than zero, like strcmp()
+int lnum_compare(lval* x, lval* y) {
+
+	if(LTYPE(x) == LVAL_DOUBLE && LTYPE(y) == LVAL_DOUBLE)
+		return (x->dbl > y->dbl) - (x->dbl < y->dbl);
+
+	limb xb[LONG_LIMBS], yb[LONG_LIMBS];
+	if(LTYPE(x) == LVAL_DOUBLE) return -lnum_compare_double(lbig_of(y, yb), x->dbl);
+	if(LTYPE(y) == LVAL_DOUBLE) return lnum_compare_double(lbig_of(x, xb), y->dbl);
+	return lbig_cmp(lbig_of(x, xb), lbig_of(y, yb));
+
+}
+
+/* Reading and printing */
+
+#define LNUM_DIGITS 9  //Decimal digits that fit in a limb
+#define LNUM_DIGITS_BASE 1000000000
+
+//Make a number out of the len decimal digits at str
+lval* lnum_read(char* str, size_t len, bool neg) {
+
+	if(len / LNUM_DIGITS > LNUM_MAX_LIMBS) return lval_err("Number too large");
+
+	limb* d = calloc(len / LNUM_DIGITS + 1, sizeof(limb));
+	int size = 0;
+	for(size_t i = 0; i < len;) {
+		//Take as many digits as we can at once
+		limb chunk = 0;
+		limb scale = 1;
+		for(int k = 0; k < LNUM_DIGITS && i < len; k++, i++) {
+			chunk = chunk * 10 + (str[i] - '0');
+			scale *= 10;
+		}
+
+		dlimb carry = chunk;
+		for(int j = 0; j < size; j++) {
+			carry += (dlimb) d[j] * scale;
+			d[j] = (limb) carry;
+			carry >>= LIMB_BITS;
+		}
+		if(carry) d[size++] = (limb) carry;
+	}
+	return lval_bignum(neg, size, d);
+
+}
+
+static void lnum_print_double(lbuf* b, double x) {
+
+	//The shortest of these which reads back as the same double
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.15g", x);
+	if(strtod(buf, NULL) != x) snprintf(buf, sizeof(buf), "%.17g", x);
+
+	lbuf_puts(b, buf);
+	if(!strpbrk(buf, ".e")) lbuf_puts(b, ".0");  //So it reads back as a double
+
+}
+
+void lnum_print(lbuf* b, lval* v) {
+
+	if(LTYPE(v) == LVAL_DOUBLE) {
+		lnum_print_double(b, v->dbl);
+		return;
+	}
+
+	//Peel off LNUM_DIGITS digits at a time, least significant first
+	int size = v->nlimbs;
+	limb* d = malloc(sizeof(limb) * size);
+	memcpy(d, v->limbs, sizeof(limb) * size);
+	limb* chunks = malloc(sizeof(limb) * (size * 2 + 1));
+	int n = 0;
+	do {
+		dlimb k = 0;
+		for(int j = size - 1; j >= 0; j--) {
+			k = (k << LIMB_BITS) | d[j];
+			d[j] = (limb) (k / LNUM_DIGITS_BASE);
+			k %= LNUM_DIGITS_BASE;
+		}
+		chunks[n++] = (limb) k;
+		while(size && !d[size - 1]) size--;
+	} while(size);
+
+	if(v->neg) lbuf_putc(b, '-');
+	lbuf_num(b, chunks[--n]);
+	while(n--) {
+		char digits[LNUM_DIGITS];
+		for(int k = LNUM_DIGITS - 1; k >= 0; k--, chunks[n] /= 10)
+			digits[k] = (char) ('0' + chunks[n] % 10);
+		lbuf_write(b, digits, LNUM_DIGITS);
+	}
+
+	free(d);
+	free(chunks);
+
+}
@@ -0,0 +1,618 @@
+/**
+ * lisp-forty, a lisp interpreter
+ * Copyright (C) 2014-16 Sean Anderson
+ *
+ * This file is part of lisp-forty.
+ *
+ * lisp-forty is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lisp-forty.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// For clock_gettime
+#define _POSIX_C_SOURCE 199309L
+
+#include <setjmp.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "lisp.h"
+
+/* lvals and lenvs are all the same size, so instead of asking malloc for every
+ * single one we carve them out of big slabs. Free cells are kept in an
+ * intrusive singly-linked list threaded through the cells themselves, so
+ * allocating and freeing is just a pointer swap.
+ */
+
+//Round a cell size up so every cell in a slab is suitably aligned
+#define LPOOL_ALIGN(size) (((size) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+//A slab header, followed by LPOOL_SLAB_CELLS cells
+typedef struct lslab {
+	struct lslab* next;
+#ifdef LISP_GC_MARK_SWEEP
+	lpool* pool;
+	bool young;  //Part of the nursery
+	int used;  //Cells of a young slab handed out since the nursery was last reset
+	unsigned char state[LPOOL_SLAB_CELLS];  //LPOOL_FREE, LPOOL_LIVE or LPOOL_MARKED
+#endif
+	alignas(max_align_t) char cells[];
+} lslab;
+
+lpool lval_pool = {"lval", LPOOL_ALIGN(sizeof(lval)), NULL, NULL, 0, 0, 0, LPOOL_GC_MIN_SLABS};
+lpool lenv_pool = {"lenv", LPOOL_ALIGN(sizeof(lenv)), NULL, NULL, 0, 0, 0, LPOOL_GC_MIN_SLABS};
+
+#ifdef LISP_GC_MARK_SWEEP
+enum {LPOOL_FREE, LPOOL_LIVE, LPOOL_MARKED};
+
+_Static_assert(sizeof(lslab) + LPOOL_ALIGN(sizeof(lval)) * LPOOL_SLAB_CELLS <= LPOOL_SLAB_BYTES, "lval slabs don't fit");
+_Static_assert(sizeof(lslab) + LPOOL_ALIGN(sizeof(lenv)) * LPOOL_SLAB_CELLS <= LPOOL_SLAB_BYTES, "lenv slabs don't fit");
+
+//Every slab from both pools, sorted by address
+static lslab** lpool_heap = NULL;
+static long lpool_heap_count = 0;
+
+static lslab* lpool_slab(void* cell) {
+	return (lslab*) ((uintptr_t) cell & ~((uintptr_t) LPOOL_SLAB_BYTES - 1));
+}
+
+static unsigned char* lpool_state(void* cell) {
+
+	lslab* slab = lpool_slab(cell);
+	return &slab->state[((char*) cell - slab->cells) / slab->pool->size];
+
+}
+
+//Keep track of a new slab so we can tell whether a word on the stack points into it
+static void lpool_heap_add(lslab* slab) {
+
+	lpool_heap = realloc(lpool_heap, sizeof(lslab*) * (lpool_heap_count + 1));
+	long i = lpool_heap_count++;
+	for(; i > 0 && lpool_heap[i - 1] > slab; i--)
+		lpool_heap[i] = lpool_heap[i - 1];
+	lpool_heap[i] = slab;
+
+}
+#endif
+
+static lslab* lpool_slab_new(lpool* p) {
+
+#ifdef LISP_GC_MARK_SWEEP
+	lslab* slab = aligned_alloc(LPOOL_SLAB_BYTES, LPOOL_SLAB_BYTES);
+#else
+	lslab* slab = malloc(sizeof(lslab) + p->size * LPOOL_SLAB_CELLS);
+#endif
+	if(slab == NULL) {
+		fputs("Out of memory\n", stderr);
+		abort();
+	}
+
+#ifdef LISP_GC_MARK_SWEEP
+	slab->pool = p;
+	slab->young = false;
+	slab->used = 0;
+	memset(slab->state, LPOOL_FREE, sizeof(slab->state));
+	lpool_heap_add(slab);
+#else
+	UNUSED(p);
+#endif
+	return slab;
+
+}
+
+//Grab a new slab and thread all of its cells onto the free list
+static void lpool_grow(lpool* p) {
+
+	lslab* slab = lpool_slab_new(p);
+	slab->next = p->slabs;
+	p->slabs = slab;
+	p->slab_count++;
+
+	//Link the cells back to front so we hand them out in address order
+	for(int i = LPOOL_SLAB_CELLS - 1; i >= 0; i--) {
+		void** cell = (void**) (slab->cells + p->size * i);
+		*cell = p->free;
+		p->free = cell;
+	}
+
+}
+
+void* lpool_alloc(lpool* p) {
+
+	if(p->free == NULL) {
+#ifdef LISP_GC_MARK_SWEEP
+		if(p->slab_count >= p->gc_slabs) lpool_collect();
+		if(p->free == NULL)
+#endif
+		lpool_grow(p);
+	}
+
+	void** cell = p->free;
+	p->free = *cell;
+#ifdef LISP_GC_MARK_SWEEP
+	*lpool_state(cell) = LPOOL_LIVE;
+#endif
+
+	if(++p->live > p->peak) p->peak = p->live;
+	return cell;
+
+}
+
+void lpool_free(lpool* p, void* cell) {
+
+#ifdef LISP_GC_MARK_SWEEP
+	*lpool_state(cell) = LPOOL_FREE;
+#endif
+	*(void**) cell = p->free;
+	p->free = cell;
+	p->live--;
+
+}
+
+//Give every slab back at once, whether or not the cells in it are still in use
+void lpool_release(lpool* p) {
+
+	while(p->slabs) {
+		lslab* next = p->slabs->next;
+		free(p->slabs);
+		p->slabs = next;
+	}
+
+	p->free = NULL;
+	p->live = 0;
+	p->slab_count = 0;
+
+}
+
+#ifdef LISP_GC_MARK_SWEEP
+static void lpool_sweep(lpool*);
+static void lpool_sweep_nursery();
+static void lpool_nursery_release();
+#endif
+
+void lpool_cleanup() {
+
+#ifdef LISP_GC_MARK_SWEEP
+	//Nothing was marked, so this finalizes everything
+	lpool_sweep(&lval_pool);
+	lpool_sweep(&lenv_pool);
+	lpool_nursery_release();
+	free(lpool_heap);
+	lpool_heap = NULL;
+	lpool_heap_count = 0;
+#endif
+	lpool_release(&lval_pool);
+	lpool_release(&lenv_pool);
+
+}
+
+//Return {live slabs peak} for a pool
+lval* lpool_stats(lpool* p) {
+
+	lpool snapshot = *p;  //Building the result allocates from the pool, so don't count that
+
+	lval* stats = lval_qexpr();
+	stats = lval_append(stats, lval_num(snapshot.live));
+	stats = lval_append(stats, lval_num(snapshot.slab_count));
+	stats = lval_append(stats, lval_num(snapshot.peak));
+	return stats;
+
+}
+
+#ifdef LISP_GC_MARK_SWEEP
+/* A conservative mark-sweep collector
+ * Cells reachable from the roots are marked with an explicit stack of cells
+ * whose children still need marking, then every unmarked live cell is
+ * finalized and put back on its pool's free list. Since anything on the C
+ * stack that points into a slab counts as a root, nothing has to register the
+ * values it's working on.
+ */
+
+lenv* lpool_root = NULL;
+void* lpool_stack_base = NULL;
+
+//Cells which have been marked but whose children haven't
+static void** lpool_gray = NULL;
+static long lpool_gray_count = 0;
+static long lpool_gray_max = 0;
+
+static long lpool_collections = 0;
+static long lpool_pause_total = 0;  //Nanoseconds
+static long lpool_pause_max = 0;
+
+static void lpool_mark_cell(void* cell) {
+
+	unsigned char* state = lpool_state(cell);
+	if(*state != LPOOL_LIVE) return;  //Already marked
+	*state = LPOOL_MARKED;
+
+	if(lpool_gray_count == lpool_gray_max) {
+		lpool_gray_max = lpool_gray_max ? lpool_gray_max * 2 : 256;
+		lpool_gray = realloc(lpool_gray, sizeof(void*) * lpool_gray_max);
+	}
+	lpool_gray[lpool_gray_count++] = cell;
+
+}
+
+void lpool_mark(lval* v) {
+
+	if(!LFIXNUM(v) && v->type != LVAL_BOOL) lpool_mark_cell(v);  //Fixnums and booleans aren't in a pool
+
+}
+
+//Mark everything cell points to
+static void lpool_trace(void* cell) {
+
+	if(lpool_slab(cell)->pool == &lenv_pool) {
+		lenv* e = cell;
+		if(e->par) lpool_mark_cell(e->par);
+		for(int i = 0; i < e->max; i++)
+			if(e->table[i].v) lpool_mark(e->table[i].v);
+		return;
+	}
+
+	lval* v = cell;
+	switch(v->type) {
+		case(LVAL_SEXPR):
+		case(LVAL_QEXPR):
+			if(v->owner) {  //Everything in the owner has to stay alive, not just our cells
+				lpool_mark_cell(v->owner);
+				break;
+			}
+			for(int i = 0; i < v->count; i++)
+				lpool_mark(v->cell[i]);
+			break;
+		case(LVAL_MAP):
+			for(int i = 0; i < v->nslots; i++) {
+				if(!LMAP_FULL(v, i)) continue;
+				lpool_mark(v->slots[i].key);
+				lpool_mark(v->slots[i].val);
+			}
+			break;
+		case(LVAL_FUNC): if(!v->builtin) {
+			lpool_mark(v->code->formals);
+			lpool_mark(v->code->body);
+			for(int i = 0; i < v->code->nconsts; i++)
+				lpool_mark(v->code->consts[i]);
+			for(largs* a = v->bound; a; a = a->prev)
+				for(int i = 0; i < a->count; i++)
+					lpool_mark(a->cell[i]);
+		} break;
+		default: break;
+	}
+
+}
+
+//Mark the cell word points into, if it points into one at all
+static void lpool_mark_word(void* word) {
+
+	lslab* slab = lpool_slab(word);
+	long lo = 0, hi = lpool_heap_count;
+	while(lo < hi) {
+		long mid = (lo + hi) / 2;
+		if(lpool_heap[mid] < slab) lo = mid + 1;
+		else hi = mid;
+	}
+	if(lo == lpool_heap_count || lpool_heap[lo] != slab) return;
+
+	if((char*) word < slab->cells) return;
+	size_t i = ((char*) word - slab->cells) / slab->pool->size;
+	if(i >= LPOOL_SLAB_CELLS) return;
+	if(slab->young && i >= (size_t) slab->used) return;  //Left over from before the nursery was reset
+	lpool_mark_cell(slab->cells + slab->pool->size * i);
+
+}
+
+//Reading the stack trips up AddressSanitizer
+#if defined(__GNUC__)
+__attribute__((noinline, no_sanitize_address))
+#endif
+static void lpool_mark_stack() {
+
+	jmp_buf regs;
+	setjmp(regs);  //Spill callee-saved registers so we see anything only they hold
+
+	char* top = (char*) &regs;
+	char* base = lpool_stack_base;
+	if(top > base) {  //The stack might grow up
+		char* tmp = top;
+		top = base;
+		base = tmp;
+	}
+
+	top = (char*) (((uintptr_t) top + sizeof(void*) - 1) & ~((uintptr_t) sizeof(void*) - 1));
+	for(void** word = (void**) top; (char*) word < base; word++)
+		lpool_mark_word(*word);
+
+}
+
+//Finalize every unmarked cell and unmark the rest
+static void lpool_sweep(lpool* p) {
+
+	p->free = NULL;
+	p->live = 0;
+	for(lslab* slab = p->slabs; slab; slab = slab->next) {
+		for(int i = LPOOL_SLAB_CELLS - 1; i >= 0; i--) {
+			void* cell = slab->cells + p->size * i;
+			if(slab->state[i] == LPOOL_MARKED) {
+				slab->state[i] = LPOOL_LIVE;
+				p->live++;
+				continue;
+			}
+
+			if(slab->state[i] == LPOOL_LIVE) {
+				if(p == &lval_pool) lval_clear(cell);
+				else lenv_clear(cell);
+				slab->state[i] = LPOOL_FREE;
+			}
+			*(void**) cell = p->free;
+			p->free = cell;
+		}
+	}
+
+	p->gc_slabs = 2 * (p->live / LPOOL_SLAB_CELLS + 1);
+	if(p->gc_slabs < LPOOL_GC_MIN_SLABS) p->gc_slabs = LPOOL_GC_MIN_SLABS;
+
+}
+
+void lpool_collect() {
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if(lpool_root) lpool_mark_cell(lpool_root);
+	lvm_mark();
+	if(lpool_stack_base) lpool_mark_stack();
+	while(lpool_gray_count)
+		lpool_trace(lpool_gray[--lpool_gray_count]);
+
+	lpool_sweep(&lval_pool);
+	lpool_sweep(&lenv_pool);
+	lpool_sweep_nursery();
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long pause = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+	lpool_collections++;
+	lpool_pause_total += pause;
+	if(pause > lpool_pause_max) lpool_pause_max = pause;
+
+}
+
+/* The nursery
+ * Most lvals die during the top-level form that made them, so while a form is
+ * being evaluated lvals are bump-allocated out of young slabs instead of
+ * coming off the free list. Anything that has to outlive the form is copied
+ * out with lval_promote(): lenv_put() does that for the global environment, and
+ * parse() does it for the value it hands back to the REPL. Once the outermost
+ * form is done every young slab can be reused from the start.
+ * Most young cells, like doubles and symbols, don't own any memory, so only the
+ * ones which do are kept in a list to be finalized. Resetting the nursery
+ * costs one lval_clear() for each of those plus a pointer swap for each slab;
+ * the other cells cost nothing. Past the bump pointer, states are stale.
+ * The collector marks young cells like any other. If the nursery fills up
+ * partway through a form, a collection lets us reuse the young slabs which
+ * don't have anything live left in them.
+ */
+static struct {
+	int depth;  //How many forms deep we are
+	lslab* current;  //The slab we're bumping through
+	lslab* full;
+	lslab* empty;
+	long slab_count;
+	long gc_slabs;  //Collect instead of growing past this many slabs
+	long allocs;
+	long resets;
+
+	//Young cells which own memory that lval_clear() has to free
+	lval** owners;
+	long owner_count;
+	long owner_max;
+} lpool_nursery = {0, NULL, NULL, NULL, 0, LPOOL_NURSERY_SLABS, 0, 0, NULL, 0, 0};
+
+bool lpool_young(void* cell) {
+
+	return lpool_slab(cell)->young;
+
+}
+
+//Finalize the unmarked cells slab has handed out, and say if any were marked
+static bool lpool_sweep_young(lslab* slab) {
+
+	bool live = false;
+	for(int i = 0; i < slab->used; i++) {
+		if(slab->state[i] == LPOOL_MARKED) {
+			slab->state[i] = LPOOL_LIVE;
+			live = true;
+		} else if(slab->state[i] == LPOOL_LIVE) {
+			lval_clear((lval*) (slab->cells + lval_pool.size * i));
+			slab->state[i] = LPOOL_FREE;
+		}
+	}
+	return live;
+
+}
+
+//Sweep the nursery, moving every young slab without anything live in it to the empty list
+static void lpool_sweep_nursery() {
+
+	long busy = 0;
+	lslab* slab = lpool_nursery.full;
+	lpool_nursery.full = NULL;
+	while(slab) {
+		lslab* next = slab->next;
+		if(lpool_sweep_young(slab)) {
+			slab->next = lpool_nursery.full;
+			lpool_nursery.full = slab;
+			busy++;
+		} else {
+			slab->used = 0;
+			slab->next = lpool_nursery.empty;
+			lpool_nursery.empty = slab;
+		}
+		slab = next;
+	}
+
+	if(lpool_nursery.current) {
+		if(lpool_sweep_young(lpool_nursery.current)) busy++;
+		else lpool_nursery.current->used = 0;
+	}
+
+	//Only the owners which survived are left to finalize
+	long n = 0;
+	for(long i = 0; i < lpool_nursery.owner_count; i++) {
+		lval* v = lpool_nursery.owners[i];
+		if(*lpool_state(v) == LPOOL_LIVE) lpool_nursery.owners[n++] = v;
+	}
+	lpool_nursery.owner_count = n;
+
+	lpool_nursery.gc_slabs = 2 * busy;
+	if(lpool_nursery.gc_slabs < LPOOL_NURSERY_SLABS) lpool_nursery.gc_slabs = LPOOL_NURSERY_SLABS;
+
+}
+
+//Move on to another young slab, reusing an empty one if we can
+static void lpool_nursery_next() {
+
+	lpool_nursery.current->next = lpool_nursery.full;
+	lpool_nursery.full = lpool_nursery.current;
+	lpool_nursery.current = NULL;
+
+	if(!lpool_nursery.empty && lpool_nursery.slab_count >= lpool_nursery.gc_slabs) lpool_collect();
+
+	if(lpool_nursery.empty) {
+		lpool_nursery.current = lpool_nursery.empty;
+		lpool_nursery.empty = lpool_nursery.empty->next;
+	} else {
+		lpool_nursery.current = lpool_slab_new(&lval_pool);
+		lpool_nursery.current->young = true;
+		lpool_nursery.slab_count++;
+	}
+	lpool_nursery.current->used = 0;
+
+}
+
+/* Allocate an lval, out of the nursery if we're in the middle of a form
+ * owns says whether it will hold on to memory which lval_clear() frees
+ */
+void* lpool_alloc_young(bool owns) {
+
+	if(!lpool_nursery.depth) return lpool_alloc(&lval_pool);
+
+	if(lpool_nursery.current->used == LPOOL_SLAB_CELLS) lpool_nursery_next();
+
+	lslab* slab = lpool_nursery.current;
+	int i = slab->used++;
+	slab->state[i] = LPOOL_LIVE;
+	lpool_nursery.allocs++;
+	lval* v = (lval*) (slab->cells + lval_pool.size * i);
+
+	if(owns) {
+		if(lpool_nursery.owner_count == lpool_nursery.owner_max) {
+			lpool_nursery.owner_max = lpool_nursery.owner_max ? lpool_nursery.owner_max * 2 : LPOOL_SLAB_CELLS;
+			lpool_nursery.owners = realloc(lpool_nursery.owners, sizeof(lval*) * lpool_nursery.owner_max);
+		}
+		lpool_nursery.owners[lpool_nursery.owner_count++] = v;
+	}
+	return v;
+
+}
+
+void lpool_nursery_enter() {
+
+	if(lpool_nursery.depth++) return;
+
+	if(!lpool_nursery.current) {
+		lpool_nursery.current = lpool_slab_new(&lval_pool);
+		lpool_nursery.current->young = true;
+		lpool_nursery.slab_count++;
+	}
+
+}
+
+/* Once the outermost form is done, nothing is left in the nursery that anyone can see
+ * So there's no need to look at the cells: the owners are finalized, and every
+ * slab starts over.
+ */
+void lpool_nursery_leave() {
+
+	if(--lpool_nursery.depth) return;
+
+	for(long i = 0; i < lpool_nursery.owner_count; i++)
+		lval_clear(lpool_nursery.owners[i]);
+	lpool_nursery.owner_count = 0;
+
+	while(lpool_nursery.full) {
+		lslab* slab = lpool_nursery.full;
+		lpool_nursery.full = slab->next;
+		slab->used = 0;
+		slab->next = lpool_nursery.empty;
+		lpool_nursery.empty = slab;
+	}
+	lpool_nursery.current->used = 0;
+
+	lpool_nursery.gc_slabs = LPOOL_NURSERY_SLABS;
+	lpool_nursery.resets++;
+
+}
+
+//Finalize and free every young slab
+static void lpool_nursery_release() {
+
+	lpool_sweep_nursery();
+	lslab* slab = lpool_nursery.empty;
+	while(slab) {
+		lslab* next = slab->next;
+		free(slab);
+		slab = next;
+	}
+	free(lpool_nursery.current);
+	free(lpool_nursery.owners);
+
+	lpool_nursery.current = NULL;
+	lpool_nursery.empty = NULL;
+	lpool_nursery.slab_count = 0;
+	lpool_nursery.owners = NULL;
+	lpool_nursery.owner_count = 0;
+	lpool_nursery.owner_max = 0;
+
+}
+
+//Return {allocations slabs resets} for the nursery
+lval* lpool_nursery_stats() {
+
+	long allocs = lpool_nursery.allocs;  //Don't count the result
+
+	lval* stats = lval_qexpr();
+	stats = lval_append(stats, lval_num(allocs));
+	stats = lval_append(stats, lval_num(lpool_nursery.slab_count));
+	stats = lval_append(stats, lval_num(lpool_nursery.resets));
+	return stats;
+
+}
+
+//Return {collections total-pause-us max-pause-us heap-bytes}
+lval* lpool_gc_stats() {
+
+	long heap = (lval_pool.slab_count + lenv_pool.slab_count + lpool_nursery.slab_count) * LPOOL_SLAB_BYTES;
+
+	lval* stats = lval_qexpr();
+	stats = lval_append(stats, lval_num(lpool_collections));
+	stats = lval_append(stats, lval_num(lpool_pause_total / 1000));
+	stats = lval_append(stats, lval_num(lpool_pause_max / 1000));
+	stats = lval_append(stats, lval_num(heap));
+	return stats;
+
+}
+#endif
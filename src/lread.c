@@ -0,0 +1,552 @@
+/**
+ * lisp-forty, a lisp interpreter
+ * Copyright (C) 2014-16 Sean Anderson
+ *
+ * This file is part of lisp-forty.
+ *
+ * lisp-forty is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lisp-forty.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// For mmap() and fileno()
+#define _POSIX_C_SOURCE 200112L
+
+#ifndef WINDOWS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "lisp.h"
+
+/* The reader turns source text straight into lvals in a single pass
+ * It reads the same language the old mpc grammar did:
+ *   number  : -?[0-9]+
+ *   double  : -?[0-9]+(\.[0-9]+)?([eE][-+]?[0-9]+)? with a . or an exponent
+ *   boolean : true | false
+ *   string  : "..." with C escapes
+ *   comment : ; up to the end of the line
+ *   symbol  : [a-zA-Z0-9_+\-%*\/\\=<>!&.]+
+ *   sexpr   : '(' expr* ')'
+ *   qexpr   : '{' expr* '}'
+ *   vector  : '[' number* ']'
+ * A run of symbol characters is read as a whole and then sorted into a number,
+ * a boolean or a symbol, so 5abc is one symbol instead of 5 followed by abc.
+ */
+
+typedef struct lreader {
+	char* name;  //For error messages
+	char* buf;
+	int line;  //Where buf starts in the source
+	int col;
+	char* pos;
+	char* end;
+	int depth;  //How many lists we're inside
+	lval* err;  //The first syntax error
+} lreader;
+
+/* Files are read a line at a time, and only as far as the end of the next form
+ * Input that has already been read is dropped from the front of buf whenever
+ * more is needed, so buf only ever has to hold the biggest form.
+ */
+struct lstream{
+	lreader r;  //r.buf is the whole buffer
+	FILE* f;  //NULL if all of the input is in r.buf already
+	bool eof;
+	size_t len;  //Bytes in r.buf
+	size_t max;  //Size of r.buf, or 0 if it isn't ours
+	bool mapped;  //r.buf is a file mapped in by lstream_open()
+	bool close;  //f was opened by lstream_open()
+	size_t pos;  //Where the next form starts
+
+	//Where lstream_scan() got to in the current form
+	char kind;  //First character of the form, or 0 if we haven't found it yet
+	size_t scan;
+	int depth;
+	bool comment;
+	bool string;
+};
+
+//Smallest amount lstream_fill() reads at a time
+#define LSTREAM_READ 4096
+
+//How deeply lists can be nested before the reader gives up, rather than the stack
+#define LREAD_DEPTH 1024
+
+//Characters which can make up a symbol or number
+static bool lread_symbol_char(char c) {
+
+	switch(c) {
+		case '_': case '+': case '-': case '%': case '*':
+		case '/': case '\\': case '=': case '<': case '>':
+		case '!': case '&': case '.':
+			return true;
+		default:
+			return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+	}
+
+}
+
+//Move the line and column of r->buf along by n bytes
+static void lread_advance(lreader* r, size_t n) {
+
+	for(char* c = r->buf; c < r->buf + n; c++)
+		if(*c == '\n') {
+			r->line++;
+			r->col = 1;
+		} else r->col++;
+
+}
+
+/* Record a syntax error at the position at
+ * Lines aren't counted while reading since errors are rare, so we count them here
+ */
+static lval* lread_err(lreader* r, char* at, char* fmt, ...) {
+
+	lreader here = *r;
+	lread_advance(&here, at - r->buf);
+
+	char msg[LVAL_ERR_MAX];
+	va_list va;
+	va_start(va, fmt);
+	vsnprintf(msg, LVAL_ERR_MAX, fmt, va);
+	va_end(va);
+
+	r->err = lval_err("%s:%i:%i: %s", r->name, here.line, here.col, msg);
+	return NULL;
+
+}
+
+static bool lread_space_char(char c) {
+
+	switch(c) {
+		case ' ': case '\n': case '\t': case '\r': case '\f': case '\v':
+			return true;
+		default:
+			return false;
+	}
+
+}
+
+//Skip whitespace and comments
+static void lread_space(lreader* r) {
+
+	while(r->pos < r->end) {
+		if(lread_space_char(*r->pos)) r->pos++;
+		else if(*r->pos == ';') while(r->pos < r->end && *r->pos != '\n') r->pos++;
+		else return;
+	}
+
+}
+
+static bool lread_digits(char** c, char* end) {
+
+	char* start = *c;
+	while(*c < end && **c >= '0' && **c <= '9') (*c)++;
+	return *c > start;
+
+}
+
+//Whether the len characters at c are a double, see the grammar up top
+static bool lread_double(char* c, size_t len) {
+
+	char* end = c + len;
+	bool point = false, exponent = false;
+
+	if(*c == '-') c++;
+	if(!lread_digits(&c, end)) return false;
+	if(c < end && *c == '.') {
+		c++;
+		if(!lread_digits(&c, end)) return false;
+		point = true;
+	}
+	if(c < end && (*c == 'e' || *c == 'E')) {
+		c++;
+		if(c < end && (*c == '-' || *c == '+')) c++;
+		if(!lread_digits(&c, end)) return false;
+		exponent = true;
+	}
+	return c == end && (point || exponent);
+
+}
+
+/* Read a run of symbol characters as a number, boolean, or symbol
+ * Tokens are looked at where they are in the source, which might not have a
+ * terminator after it, so nothing here can use the str* functions
+ */
+static lval* lread_atom(lreader* r) {
+
+	char* start = r->pos;
+	while(r->pos < r->end && lread_symbol_char(*r->pos)) r->pos++;
+	size_t len = r->pos - start;
+
+	bool negative = start[0] == '-' && len > 1;
+	bool number = true;
+	unsigned long num = 0;
+	for(char* c = start + negative; c < r->pos; c++) {
+		if(*c < '0' || *c > '9') {
+			number = false;
+			break;
+		}
+		if(num > (ULONG_MAX - (*c - '0')) / 10) num = ULONG_MAX;  //Saturate, it's too big either way
+		else num = num * 10 + (*c - '0');
+	}
+	if(number && !(len == 1 && negative)) {
+		if(negative ? num > (unsigned long) LONG_MAX + 1 : num > LONG_MAX) return lnum_read(start + negative, len - negative, negative);
+		return lval_num(negative ? (long) (0 - num) : (long) num);
+	}
+	if(lread_double(start, len)) {
+		char* str = malloc(len + 1);  //strtod() needs a terminator
+		memcpy(str, start, len);
+		str[len] = '\0';
+		double d = strtod(str, NULL);
+		free(str);
+		if(isinf(d)) return lval_err("Number too large");  //Like lnum_read(), doubles can't be infinite
+		return lval_double(d);
+	}
+
+	if(len == 4 && memcmp(start, "true", 4) == 0) return LVAL_TRUE;
+	if(len == 5 && memcmp(start, "false", 5) == 0) return LVAL_FALSE;
+	return lval_sym_n(start, len);
+
+}
+
+static char lread_unescape(char c) {
+
+	switch(c) {
+		case 'a': return '\a';
+		case 'b': return '\b';
+		case 'f': return '\f';
+		case 'n': return '\n';
+		case 'r': return '\r';
+		case 't': return '\t';
+		case 'v': return '\v';
+		case '\\': return '\\';
+		case '\'': return '\'';
+		case '"': return '"';
+		case '0': return '\0';
+		default: return 0;
+	}
+
+}
+
+static lval* lread_str(lreader* r) {
+
+	char* start = r->pos++;  //Skip the "
+	char* end = r->pos;
+	for(; end < r->end && *end != '"'; end++)
+		if(*end == '\\' && end + 1 < r->end) end++;
+	if(end >= r->end) return lread_err(r, start, "unterminated string");
+
+	//The unescaped string is never longer than the escaped one, so it can be done in place
+	lstr* s = lstr_new(r->pos, end - r->pos);
+	char* out = s->data;
+	char* stop = s->data + s->len;
+	for(char* in = s->data; in < stop; in++) {
+		if(*in == '\\' && in + 1 < stop) {
+			char c = lread_unescape(in[1]);
+			if(c || in[1] == '0') {
+				*out++ = c;
+				in++;
+				continue;
+			}
+		}
+		*out++ = *in;
+	}
+	*out = '\0';
+	s->len = out - s->data;
+
+	r->pos = end + 1;
+	return lval_text(s, 0, s->len);
+
+}
+
+static lval* lread_expr(lreader*);
+
+//Read expressions into list until close, returning NULL on a syntax error
+static lval* lread_list(lreader* r, lval* list, char close) {
+
+	char* start = r->pos;
+	if(r->depth >= LREAD_DEPTH) {
+		lval_del(list);
+		return lread_err(r, start, "nested too deeply");
+	}
+
+	r->pos++;  //Skip the opening bracket
+	r->depth++;
+	for(lread_space(r); r->pos < r->end && *r->pos != close; lread_space(r)) {
+		lval* x = lread_expr(r);
+		if(x == NULL) {
+			lval_del(list);
+			return NULL;
+		}
+		list = lval_append(list, x);
+	}
+	r->depth--;
+
+	if(r->pos >= r->end) {
+		lval_del(list);
+		return lread_err(r, start, "unclosed '%c'", *start);
+	}
+	r->pos++;
+	return list;
+
+}
+
+static lval* lread_vec(lreader* r) {
+
+	char* start = r->pos;
+	lval* list = lread_list(r, lval_qexpr(), ']');
+	if(list == NULL) return NULL;
+
+	long* elems = lvec_alloc(list->count);
+	for(int i = 0; i < list->count; i++) {
+		if(LTYPE(list->cell[i]) != LVAL_NUM) {
+			free(elems);
+			lval_del(list);
+			return lread_err(r, start, "vectors can only hold integers");
+		}
+		elems[i] = LNUM(list->cell[i]);
+	}
+	lval* v = lval_vec(list->count, elems);
+	lval_del(list);
+	return v;
+
+}
+
+//Read the next expression, returning NULL on a syntax error
+static lval* lread_expr(lreader* r) {
+
+	char c = *r->pos;
+	if(c == '(') return lread_list(r, lval_sexp(), ')');
+	if(c == '{') return lread_list(r, lval_qexpr(), '}');
+	if(c == '[') return lread_vec(r);
+	if(c == '"') return lread_str(r);
+	if(lread_symbol_char(c)) return lread_atom(r);
+	return lread_err(r, r->pos, "unexpected '%c'", c);
+
+}
+
+//Read from f, which is called name
+lstream* lstream_new(char* name, FILE* f) {
+
+	lstream* s = calloc(1, sizeof(lstream));
+	s->r.name = name;
+	s->r.line = 1;
+	s->r.col = 1;
+	s->f = f;
+	s->max = LSTREAM_READ;
+	s->r.buf = malloc(s->max);
+	return s;
+
+}
+
+//Read len bytes from buf, which must stay around until the lstream is deleted
+lstream* lstream_mem(char* name, char* buf, size_t len) {
+
+	lstream* s = calloc(1, sizeof(lstream));
+	s->r.name = name;
+	s->r.line = 1;
+	s->r.col = 1;
+	s->r.buf = buf;
+	s->r.end = buf + len;
+	s->eof = true;
+	s->len = len;
+	return s;
+
+}
+
+/* Open the file called name
+ * Regular files are mapped straight in and read like lstream_mem(), so nothing
+ * gets copied out of the page cache. Anything else is read through stdio.
+ * Returns NULL and leaves errno set if the file can't be opened.
+ */
+lstream* lstream_open(char* name) {
+
+	FILE* f = fopen(name, "rb");
+	if(f == NULL) return NULL;
+
+#ifndef WINDOWS
+	struct stat st;
+	if(fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void* map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if(map != MAP_FAILED) {
+			fclose(f);  //The mapping keeps the file around
+			posix_madvise(map, (size_t) st.st_size, POSIX_MADV_SEQUENTIAL);
+			lstream* s = lstream_mem(name, map, (size_t) st.st_size);
+			s->mapped = true;
+			return s;
+		}
+	}
+#endif
+
+	lstream* s = lstream_new(name, f);
+	s->close = true;
+	return s;
+
+}
+
+void lstream_del(lstream* s) {
+
+#ifndef WINDOWS
+	if(s->mapped) munmap(s->r.buf, s->len);
+#endif
+	if(s->close) fclose(s->f);
+	if(s->max) free(s->r.buf);
+	free(s);
+
+}
+
+//Take the syntax error which stopped lread_next(), if there was one
+lval* lstream_err(lstream* s) {
+
+	lval* err = s->r.err;
+	s->r.err = NULL;
+	return err;
+
+}
+
+//Read another line from f, dropping everything before the current form
+static void lstream_fill(lstream* s) {
+
+	if(s->pos) {
+		lread_advance(&s->r, s->pos);
+		memmove(s->r.buf, s->r.buf + s->pos, s->len - s->pos);
+		s->len -= s->pos;
+		if(s->kind) s->scan -= s->pos;
+		s->pos = 0;
+	}
+	while(s->max - s->len < LSTREAM_READ) s->r.buf = realloc(s->r.buf, s->max *= 2);
+
+	if(s->f == stdin) lbuf_flush(&lbuf_out);  //Whoever is on the other end may be waiting to see it
+	if(fgets(s->r.buf + s->len, (int) (s->max - s->len), s->f)) s->len += strlen(s->r.buf + s->len);
+	else s->eof = true;
+
+}
+
+/* Find the end of the form after s->pos, or return 0 if it isn't all here yet
+ * This doesn't check the syntax, it only finds where the reader should stop.
+ * Each call picks up where the last one left off.
+ */
+static size_t lstream_scan(lstream* s) {
+
+	char* buf = s->r.buf;
+
+	for(; !s->kind; s->pos++) {  //Skip to the start of the form
+		if(s->pos >= s->len) return 0;
+		char c = buf[s->pos];
+		if(s->comment) s->comment = c != '\n';
+		else if(c == ';') s->comment = true;
+		else if(!lread_space_char(c)) {
+			s->kind = c;
+			s->scan = s->pos + 1;
+			break;
+		}
+	}
+
+	size_t i = s->scan;
+	if(s->kind == '(' || s->kind == '{' || s->kind == '[') {
+		for(; i < s->len; i++) {
+			char c = buf[i];
+			if(s->comment) {
+				s->comment = c != '\n';
+			} else if(s->string) {
+				if(c == '\\') {
+					if(i + 1 >= s->len) break;  //Look at the escape again once we have it
+					i++;
+				} else if(c == '"') s->string = false;
+			} else if(c == ';') {
+				s->comment = true;
+			} else if(c == '"') {
+				s->string = true;
+			} else if(c == '(' || c == '{' || c == '[') {
+				s->depth++;
+			} else if(c == ')' || c == '}' || c == ']') {
+				if(s->depth-- == 0) return i + 1;
+			}
+		}
+	} else if(s->kind == '"') {
+		for(; i < s->len; i++) {
+			if(buf[i] == '\\') {
+				if(i + 1 >= s->len) break;
+				i++;
+			} else if(buf[i] == '"') return i + 1;
+		}
+	} else if(lread_symbol_char(s->kind)) {
+		while(i < s->len && lread_symbol_char(buf[i])) i++;
+		if(i < s->len) return i;
+	} else {
+		return s->pos + 1;  //This can't start a form, so leave it to lread_expr() to complain
+	}
+
+	s->scan = i;
+	return 0;
+
+}
+
+/* Read the next top-level form from s
+ * Returns NULL at the end of the input, or if there was a syntax error, in which
+ * case lstream_err() has it and nothing more will be read.
+ */
+lval* lread_next(lstream* s) {
+
+	if(s->r.err) return NULL;
+
+	if(s->f) {
+		size_t end;
+		while(!(end = lstream_scan(s))) {
+			if(s->eof) {
+				if(!s->kind) return NULL;  //Nothing left but whitespace
+				end = s->len;  //Let lread_expr() report what's missing
+				break;
+			}
+			lstream_fill(s);
+		}
+		s->r.pos = s->r.buf + s->pos;
+		s->r.end = s->r.buf + end;
+		s->kind = 0;
+		s->depth = 0;
+		s->comment = false;
+		s->string = false;
+	} else {  //The whole input is here, so the reader can find the end of the form itself
+		s->r.pos = s->r.buf + s->pos;
+		lread_space(&s->r);
+		if(s->r.pos >= s->r.end) return NULL;
+	}
+
+	lval* x = lread_expr(&s->r);
+	s->pos = s->r.pos - s->r.buf;
+	return x;
+
+}
+
+/* Read all of buf, which came from name, into an sexpr
+ * Syntax errors are returned as an lval_err with the line and column
+ */
+lval* lread(char* name, char* buf, size_t len) {
+
+	lstream* s = lstream_mem(name, buf, len);
+	lval* tree = lval_sexp();
+
+	for(lval* x; (x = lread_next(s));)
+		tree = lval_append(tree, x);
+
+	lval* err = lstream_err(s);
+	if(err) {
+		lval_del(tree);
+		tree = err;
+	}
+
+	lstream_del(s);
+	return tree;
+
+}
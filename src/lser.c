@@ -0,0 +1,654 @@
+/**
+ * lisp-forty, a lisp interpreter
+ * Copyright (C) 2014-16 Sean Anderson
+ *
+ * This file is part of lisp-forty.
+ *
+ * lisp-forty is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lisp-forty.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lisp.h"
+
+/* A binary encoding of lvals
+ * Every lval starts with one of the tags below. Counts, lengths and symbol
+ * numbers are unsigned LEB128, and numbers are zigzagged first. The first time a
+ * symbol is written it gets the next number, and after that only the number is
+ * written. Builtins are written as the symbol they were added under, since
+ * their addresses change from run to run.
+ */
+enum lser_tag {
+	LSER_NUM,  //value
+	LSER_TRUE,
+	LSER_FALSE,
+	LSER_STR,  //length, bytes
+	LSER_ERR,  //length, bytes
+	LSER_SYM,  //length, bytes
+	LSER_SYMREF,  //number
+	LSER_SEXPR,  //count, cells
+	LSER_QEXPR,  //count, cells
+	LSER_BUILTIN,  //name
+	LSER_LAMBDA,  //formals, body, count, bound arguments
+	LSER_BIGNUM,  //count << 1 | sign, limbs
+	LSER_DOUBLE,  //8 bytes, little-endian
+	LSER_VEC,  //count, values
+	LSER_MAP  //count, keys and values
+};
+
+//Written at the start of images and data, along with LSER_VERSION, so we don't try to read anything else
+static const char lser_image_magic[] = "lisp-forty image";
+static const char lser_data_magic[] = "lisp-forty data";
+
+struct lser{
+	FILE* f;  //NULL when reading from memory
+	unsigned char* buf;
+	size_t pos;
+	size_t len;  //Bytes in buf for readers
+	size_t max;  //Size of buf, or 0 if it isn't ours
+	bool error;
+	bool deep;  //The writer gave up on something nested too deeply to read back
+	int depth;  //How many lvals the reader or writer is inside
+
+	//Writers hash symbol names to their numbers, readers just list them
+	char** syms;
+	int* ids;
+	int nsyms;
+	int max_syms;
+};
+
+#define LSER_BUF 65536
+#define LSER_SYMS_INIT 64
+
+//How deeply lvals can be nested before the reader gives up, rather than the stack
+//The writer stops at the same depth, so it never writes something that can't be read
+#define LSER_DEPTH 4096
+
+static lser* lser_new(FILE* f) {
+
+	lser* s = calloc(1, sizeof(lser));
+	s->f = f;
+	s->max = LSER_BUF;
+	s->buf = malloc(s->max);
+	return s;
+
+}
+
+lser* lser_writer(FILE* f) {
+
+	lser* s = lser_new(f);
+	s->max_syms = LSER_SYMS_INIT;
+	s->syms = calloc(s->max_syms, sizeof(char*));
+	s->ids = malloc(sizeof(int) * s->max_syms);
+	return s;
+
+}
+
+lser* lser_reader(FILE* f) {
+
+	return lser_new(f);
+
+}
+
+//Read len bytes from buf, which has to stay around until the lser is deleted
+lser* lser_mem(unsigned char* buf, size_t len) {
+
+	lser* s = calloc(1, sizeof(lser));
+	s->buf = buf;
+	s->len = len;
+	return s;
+
+}
+
+//Write out anything still buffered, returning false if anything couldn't be written
+bool lser_flush(lser* s) {
+
+	if(s->f && s->pos) {
+		if(fwrite(s->buf, 1, s->pos, s->f) != s->pos) s->error = true;
+		s->pos = 0;
+	}
+	return !s->error;
+
+}
+
+void lser_del(lser* s) {
+
+	if(s->max) free(s->buf);
+	free(s->syms);
+	free(s->ids);
+	free(s);
+
+}
+
+/* Writing */
+
+static void lser_put(lser* s, void* data, size_t len) {
+
+	if(s->pos + len > s->max) {
+		lser_flush(s);
+		if(len > s->max) {  //Too big to be worth buffering
+			if(fwrite(data, 1, len, s->f) != len) s->error = true;
+			return;
+		}
+	}
+	memcpy(s->buf + s->pos, data, len);
+	s->pos += len;
+
+}
+
+static void lser_put_byte(lser* s, unsigned char c) {
+
+	if(s->pos == s->max) lser_flush(s);
+	s->buf[s->pos++] = c;
+
+}
+
+static void lser_put_uint(lser* s, unsigned long n) {
+
+	for(; n >= 0x80; n >>= 7)
+		lser_put_byte(s, (unsigned char) (n | 0x80));
+	lser_put_byte(s, (unsigned char) n);
+
+}
+
+static void lser_put_int(lser* s, long n) {
+
+	lser_put_uint(s, ((unsigned long) n << 1) ^ (n < 0 ? ULONG_MAX : 0));  //Zigzag, so small negatives stay small
+
+}
+
+static void lser_put_bytes(lser* s, enum lser_tag tag, char* str, size_t len) {
+
+	lser_put_byte(s, tag);
+	lser_put_uint(s, len);
+	lser_put(s, str, len);
+
+}
+
+//Symbols are interned, so the table only has to compare pointers
+static void lser_put_sym(lser* s, char* sym) {
+
+	int mask = s->max_syms - 1;
+	int i = (int) (LSYM(sym)->hash & mask);
+	for(; s->syms[i]; i = (i + 1) & mask)
+		if(s->syms[i] == sym) {
+			lser_put_byte(s, LSER_SYMREF);
+			lser_put_uint(s, s->ids[i]);
+			return;
+		}
+
+	s->syms[i] = sym;
+	s->ids[i] = s->nsyms++;
+	lser_put_bytes(s, LSER_SYM, sym, LSYM(sym)->len);
+
+	if(s->nsyms > s->max_syms / 2) {  //Keep the table at most half full
+		char** syms = s->syms;
+		int* ids = s->ids;
+		int max = s->max_syms;
+		s->max_syms *= 2;
+		s->syms = calloc(s->max_syms, sizeof(char*));
+		s->ids = malloc(sizeof(int) * s->max_syms);
+		for(int j = 0; j < max; j++) {
+			if(!syms[j]) continue;
+			int k = (int) (LSYM(syms[j])->hash & (s->max_syms - 1));
+			while(s->syms[k]) k = (k + 1) & (s->max_syms - 1);
+			s->syms[k] = syms[j];
+			s->ids[k] = ids[j];
+		}
+		free(syms);
+		free(ids);
+	}
+
+}
+
+//Give up on a value the reader would refuse, which is nested as deeply as depth
+static bool lser_too_deep(lser* s, int depth) {
+
+	if(depth < LSER_DEPTH) return false;
+	s->deep = true;
+	s->error = true;
+	return true;
+
+}
+
+void lser_write(lser* s, lval* v) {
+
+	if(s->error || lser_too_deep(s, s->depth)) return;
+
+	s->depth++;  //Counted like lser_read() counts them
+	switch(LTYPE(v)) {
+		case LVAL_NUM:
+			lser_put_byte(s, LSER_NUM);
+			lser_put_int(s, LNUM(v));
+			break;
+		case LVAL_BIGNUM:
+			lser_put_byte(s, LSER_BIGNUM);
+			lser_put_uint(s, (unsigned long) v->nlimbs << 1 | v->neg);
+			for(int i = 0; i < v->nlimbs; i++)
+				lser_put_uint(s, v->limbs[i]);
+			break;
+		case LVAL_DOUBLE: {
+			uint64_t bits;
+			unsigned char bytes[8];
+			memcpy(&bits, &v->dbl, sizeof(bits));
+			for(int i = 0; i < 8; i++)
+				bytes[i] = (unsigned char) (bits >> (8 * i));
+			lser_put_byte(s, LSER_DOUBLE);
+			lser_put(s, bytes, 8);
+			break;
+		}
+		case LVAL_VEC:
+			lser_put_byte(s, LSER_VEC);
+			lser_put_uint(s, v->nelems);
+			for(int i = 0; i < v->nelems; i++)
+				lser_put_int(s, v->elems[i]);
+			break;
+		case LVAL_MAP:
+			lser_put_byte(s, LSER_MAP);
+			lser_put_uint(s, v->nkeys);
+			for(int i = 0; i < v->nslots; i++) {
+				if(!LMAP_FULL(v, i)) continue;
+				lser_write(s, v->slots[i].key);
+				lser_write(s, v->slots[i].val);
+			}
+			break;
+		case LVAL_BOOL:
+			lser_put_byte(s, v == LVAL_TRUE ? LSER_TRUE : LSER_FALSE);
+			break;
+		case LVAL_STR:
+			lser_put_bytes(s, LSER_STR, lval_str_chars(v), v->len);
+			break;
+		case LVAL_ERR:
+			lser_put_bytes(s, LSER_ERR, v->str, strlen(v->str));
+			break;
+		case LVAL_SYM:
+			lser_put_sym(s, v->str);
+			break;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			lser_put_byte(s, LTYPE(v) == LVAL_SEXPR ? LSER_SEXPR : LSER_QEXPR);
+			lser_put_uint(s, v->count);
+			for(int i = 0; i < v->count; i++)
+				lser_write(s, v->cell[i]);
+			break;
+		case LVAL_FUNC:
+			if(v->builtin) {
+				if(lser_too_deep(s, s->depth)) break;  //The name is read back as a value of its own
+				lser_put_byte(s, LSER_BUILTIN);
+				lser_put_sym(s, lbuiltin_name(v->builtin));
+				break;
+			}
+			lser_put_byte(s, LSER_LAMBDA);
+			lser_write(s, v->code->formals);
+			lser_write(s, v->code->body);
+			lser_put_uint(s, v->nbound);
+			lval** bound = malloc(sizeof(lval*) * v->nbound);
+			largs_flatten(v, bound);
+			for(int i = 0; i < v->nbound; i++)
+				lser_write(s, bound[i]);
+			free(bound);
+			break;
+	}
+	s->depth--;
+
+}
+
+/* Reading */
+
+//Make sure at least len bytes are buffered, returning false if there aren't that many left
+static bool lser_want(lser* s, size_t len) {
+
+	if(s->len - s->pos >= len) return true;
+	if(!s->f) return false;
+
+	memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+	s->len -= s->pos;
+	s->pos = 0;
+	while(s->len < len) {
+		if(s->len == s->max) s->buf = realloc(s->buf, s->max *= 2);  //len is untrusted, so only grow as the input does
+		size_t n = fread(s->buf + s->len, 1, s->max - s->len, s->f);
+		if(n == 0) break;
+		s->len += n;
+	}
+	return s->len >= len;
+
+}
+
+static lval* lser_err(lser* s, char* what) {
+
+	s->error = true;
+	return lval_err("Could not deserialize: %s", what);
+
+}
+
+static bool lser_get_uint(lser* s, unsigned long* n) {
+
+	*n = 0;
+	for(unsigned shift = 0; shift < sizeof(long) * CHAR_BIT; shift += 7) {
+		if(!lser_want(s, 1)) return false;
+		unsigned char c = s->buf[s->pos++];
+		*n |= (unsigned long) (c & 0x7f) << shift;
+		if(!(c & 0x80)) return true;
+	}
+	return false;  //Too long to be one of ours
+
+}
+
+//Get len bytes, which are good until the next read
+static char* lser_get_bytes(lser* s, unsigned long* len) {
+
+	if(!lser_get_uint(s, len) || *len > INT_MAX || !lser_want(s, *len)) return NULL;
+	char* bytes = (char*) s->buf + s->pos;
+	s->pos += *len;
+	return bytes;
+
+}
+
+static lval* lser_read_list(lser* s, lval* list) {
+
+	unsigned long count;
+	if(!lser_get_uint(s, &count) || count > INT_MAX) {
+		lval_del(list);
+		return lser_err(s, "bad list length");
+	}
+	//We know how big it'll be, so skip lval_append(), but don't trust count too far
+	for(unsigned long i = 0; i < count; i++) {
+		if(i == (unsigned long) list->max) {
+			unsigned long max = i ? i * 2 : LSER_BUF;
+			lval_reserve(list, max > count ? count : max);
+		}
+		lval* x = lser_read(s);
+		if(x == NULL) x = lser_err(s, "unexpected end of input");
+		if(s->error) {
+			lval_del(list);
+			return x;
+		}
+		list->cell[list->count++] = x;
+	}
+	return list;
+
+}
+
+static lval* lser_read_map(lser* s) {
+
+	unsigned long count;
+	if(!lser_get_uint(s, &count) || count > INT_MAX) return lser_err(s, "bad map size");
+
+	lval* m = lval_map();
+	for(unsigned long i = 0; i < count; i++) {
+		lval* k = lser_read(s);
+		if(k == NULL || s->error) {
+			lval_del(m);
+			return k ? k : lser_err(s, "unexpected end of input");
+		}
+		lval* v = lser_read(s);
+		if(v == NULL || s->error || !LMAP_KEY(LTYPE(k))) {
+			lval_del(m);
+			lval_del(k);
+			if(v && s->error) return v;
+			if(v) lval_del(v);
+			return lser_err(s, v ? "bad map key" : "unexpected end of input");
+		}
+		m = lmap_put(m, k, v);
+	}
+	return m;
+
+}
+
+static lval* lser_read_lambda(lser* s) {
+
+	lval* formals = lser_read(s);
+	if(formals == NULL || s->error) return formals ? formals : lser_err(s, "unexpected end of input");
+	lval* body = lser_read(s);
+	if(body == NULL || s->error) {
+		lval_del(formals);
+		return body ? body : lser_err(s, "unexpected end of input");
+	}
+
+	bool ok = LTYPE(formals) == LVAL_QEXPR && LTYPE(body) == LVAL_QEXPR;
+	for(int i = 0; ok && i < formals->count; i++)
+		ok = LTYPE(formals->cell[i]) == LVAL_SYM;
+	if(!ok) {
+		lval_del(formals);
+		lval_del(body);
+		return lser_err(s, "bad lambda");
+	}
+	lval* func = lval_lambda(formals, body);
+
+	lval* bound = lser_read_list(s, lval_sexp());
+	if(s->error) {
+		lval_del(func);
+		return bound;
+	}
+	if(bound->count == 0) {
+		lval_del(bound);
+		return func;
+	}
+
+	lval* partial = lval_partial(func, bound, bound->count);
+	bound->count = 0;  //partial has the arguments now
+	lval_del(bound);
+	lval_del(func);
+	return partial;
+
+}
+
+#define LSER_UNZIGZAG(n) ((long) ((n) >> 1) ^ -(long) ((n) & 1))
+
+static lval* lser_read_tag(lser* s, unsigned char tag) {
+
+	unsigned long n;
+	char* bytes;
+	switch(tag) {
+		case LSER_NUM:
+			if(!lser_get_uint(s, &n)) return lser_err(s, "bad number");
+			return lval_num(LSER_UNZIGZAG(n));
+		case LSER_VEC: {
+			if(!lser_get_uint(s, &n) || n > INT_MAX) return lser_err(s, "bad vector");
+			size_t count = n;
+			//Like lser_read_list(), don't trust count any further than the input goes
+			size_t max = count < LSER_BUF ? (count ? count : 1) : LSER_BUF;
+			long* elems = malloc(sizeof(long) * max);
+			for(size_t i = 0; i < count; i++) {
+				if(i == max) {
+					max = max * 2 > count ? count : max * 2;
+					elems = realloc(elems, sizeof(long) * max);
+				}
+				if(!lser_get_uint(s, &n)) {
+					free(elems);
+					return lser_err(s, "bad vector");
+				}
+				elems[i] = LSER_UNZIGZAG(n);
+			}
+			return lval_vec((int) count, elems);
+		}
+		case LSER_BIGNUM: {
+			if(!lser_get_uint(s, &n) || n >> 1 > LNUM_MAX_LIMBS) return lser_err(s, "bad number");
+			int count = (int) (n >> 1);
+			uint32_t* limbs = malloc(sizeof(uint32_t) * count);
+			for(int i = 0; i < count; i++) {
+				unsigned long limb;
+				if(!lser_get_uint(s, &limb) || limb > UINT32_MAX) {
+					free(limbs);
+					return lser_err(s, "bad number");
+				}
+				limbs[i] = (uint32_t) limb;
+			}
+			return lval_bignum(n & 1, count, limbs);
+		}
+		case LSER_DOUBLE: {
+			if(!lser_want(s, 8)) return lser_err(s, "bad number");
+			uint64_t bits = 0;
+			for(int i = 0; i < 8; i++)
+				bits |= (uint64_t) s->buf[s->pos++] << (8 * i);
+			double dbl;
+			memcpy(&dbl, &bits, sizeof(dbl));
+			if(!isfinite(dbl)) return lser_err(s, "bad number");
+			return lval_double(dbl);
+		}
+		case LSER_TRUE:
+			return LVAL_TRUE;
+		case LSER_FALSE:
+			return LVAL_FALSE;
+		case LSER_STR:
+		case LSER_ERR:
+		case LSER_SYM:
+			if(!(bytes = lser_get_bytes(s, &n))) return lser_err(s, "bad string");
+			if(tag == LSER_STR) return lval_str_n(bytes, n);
+			if(tag == LSER_ERR) return lval_err("%.*s", (int) n, bytes);
+			if(s->nsyms == s->max_syms) {
+				s->max_syms = s->max_syms ? s->max_syms * 2 : LSER_SYMS_INIT;
+				s->syms = realloc(s->syms, sizeof(char*) * s->max_syms);
+			}
+			lval* sym = lval_sym_n(bytes, n);
+			s->syms[s->nsyms++] = sym->str;
+			return sym;
+		case LSER_SYMREF:
+			if(!lser_get_uint(s, &n) || n >= (unsigned long) s->nsyms) return lser_err(s, "bad symbol");
+			return lval_sym(s->syms[n]);
+		case LSER_MAP:
+			return lser_read_map(s);
+		case LSER_SEXPR:
+			return lser_read_list(s, lval_sexp());
+		case LSER_QEXPR:
+			return lser_read_list(s, lval_qexpr());
+		case LSER_BUILTIN: {
+			lval* name = lser_read(s);
+			if(name == NULL || s->error) return name ? name : lser_err(s, "unexpected end of input");
+			lbuiltin func = LTYPE(name) == LVAL_SYM ? lbuiltin_find(name->str) : NULL;
+			lval_del(name);
+			return func ? lval_func(func) : lser_err(s, "unknown builtin");
+		}
+		case LSER_LAMBDA:
+			return lser_read_lambda(s);
+		default:
+			return lser_err(s, "bad tag");
+	}
+
+}
+
+/* Read the next lval
+ * Returns NULL at the end of the input. Bad input gives an lval_err, after which
+ * nothing more can be read.
+ */
+lval* lser_read(lser* s) {
+
+	if(s->error) return NULL;
+	if(!lser_want(s, 1)) return NULL;
+	if(s->depth >= LSER_DEPTH) return lser_err(s, "nested too deeply");
+
+	s->depth++;  //Everything nested is read through here, so this is the only place to count
+	lval* x = lser_read_tag(s, s->buf[s->pos++]);
+	s->depth--;
+	return x;
+
+}
+
+/* Images and data */
+
+static void lser_put_header(lser* s, const char* magic) {
+
+	lser_put(s, (void*) magic, strlen(magic) + 1);
+	lser_put_uint(s, LSER_VERSION);
+
+}
+
+//Check for what lser_put_header() wrote, returning an error if it isn't there
+static lval* lser_get_header(lser* s, const char* magic, char* what) {
+
+	unsigned long version;
+	size_t len = strlen(magic) + 1;
+	if(!lser_want(s, len) || memcmp(s->buf + s->pos, magic, len) != 0)
+		return lval_err("Could not load %s: not %s", what, magic);
+	s->pos += len;
+	if(!lser_get_uint(s, &version) || version != LSER_VERSION)
+		return lval_err("Could not load %s: wrong version", what);
+	return NULL;
+
+}
+
+//Finish writing, returning why it failed or NULL if it didn't
+static char* lser_finish(lser* s) {
+
+	bool ok = lser_flush(s);
+	char* why = ok ? NULL : s->deep ? "nested too deeply" : strerror(errno);
+	lser_del(s);
+	return why;
+
+}
+
+//Write every binding in e to f, returning NULL or why it couldn't
+char* lser_save_env(lenv* e, FILE* f) {
+
+	lser* s = lser_writer(f);
+	lser_put_header(s, lser_image_magic);
+
+	for(int i = 0; i < e->max; i++) {
+		if(e->table[i].sym == NULL) continue;
+		lser_put_sym(s, e->table[i].sym);
+		lser_write(s, e->table[i].v);
+	}
+
+	return lser_finish(s);
+
+}
+
+//Add the bindings in an image made by lser_save_env() to e
+lval* lser_load_env(lenv* e, lser* s) {
+
+	lval* err = lser_get_header(s, lser_image_magic, "image");
+	if(err) return err;
+
+	for(lval* k; (k = lser_read(s));) {
+		if(LTYPE(k) == LVAL_ERR) return k;
+		lval* v = lser_read(s);
+		if(v == NULL || LTYPE(k) != LVAL_SYM) {
+			lval_del(k);
+			if(v) lval_del(v);
+			return lval_err("Could not load image: truncated");
+		}
+		if(s->error) {
+			lval_del(k);
+			return v;
+		}
+		lenv_put(e, k, v);
+		lval_del(k);
+		lval_del(v);
+	}
+
+	return lval_sexp();
+
+}
+
+//Write v to f, with a symbol table of its own, returning NULL or why it couldn't
+char* lser_save(lval* v, FILE* f) {
+
+	lser* s = lser_writer(f);
+	lser_put_header(s, lser_data_magic);
+	lser_write(s, v);
+	return lser_finish(s);
+
+}
+
+//Read back what lser_save() wrote to f
+lval* lser_load(FILE* f) {
+
+	lser* s = lser_reader(f);
+	lval* v = lser_get_header(s, lser_data_magic, "data");
+	if(v == NULL) {
+		v = lser_read(s);
+		if(v == NULL) v = lval_err("Could not load data: unexpected end of input");
+	}
+	lser_del(s);
+	return v;
+
+}
@@ -0,0 +1,223 @@
+/**
+ * lisp-forty, a lisp interpreter
+ * Copyright (C) 2014-16 Sean Anderson
+ *
+ * This file is part of lisp-forty.
+ *
+ * lisp-forty is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lisp-forty.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "lisp.h"
+
+/* Strings
+ * A string is a slice of an lstr, which is never changed once it's made, so
+ * copying a string, taking a substring, or splitting one up never copies any
+ * bytes. Concatenating two long strings makes a rope, which is O(1); its
+ * bytes are only put together the first time something reads them, and every
+ * string sharing the rope gets to keep the result.
+ */
+
+#define LSTR_LEAF(s) ((char*) ((s) + 1))  //Where a leaf keeps its bytes
+
+//A leaf holding a copy of the first len bytes of str, or room for them if str is NULL
+lstr* lstr_new(char* str, int len) {
+
+	lstr* s = malloc(sizeof(lstr) + len + 1);
+	s->refs = 1;
+	s->len = len;
+	s->depth = 0;
+	s->data = LSTR_LEAF(s);
+	s->left = NULL;
+	s->right = NULL;
+	if(str) memcpy(s->data, str, len);
+	s->data[len] = '\0';
+	return s;
+
+}
+
+static lstr* lstr_node(lstr* left, lstr* right, int len) {
+
+	lstr* s = malloc(sizeof(lstr));
+	s->refs = 1;
+	s->len = len;
+	s->depth = 0;
+	s->data = NULL;
+	s->left = left;
+	s->right = right;
+	return s;
+
+}
+
+/* Drop a reference to s
+ * Ropes can be as deep as the number of strings that went into them, so this
+ * doesn't recurse. Each dead node holding a right half still to be dropped is
+ * put on a stack, which is chained through the node's own left.
+ */
+void lstr_del(lstr* s) {
+
+	lstr* pending = NULL;
+	for(;;) {
+		if(s && --s->refs == 0) {
+			if(s->data && s->data != LSTR_LEAF(s) && !s->left) free(s->data);  //A flattened rope
+			if(s->left) {
+				lstr* left = s->left;
+				s->left = pending;
+				pending = s;
+				s = left;
+				continue;
+			}
+			free(s);
+		}
+		if(!pending) return;
+		lstr* dead = pending;
+		s = dead->right;
+		pending = dead->left;
+		free(dead);
+	}
+
+}
+
+//The bytes of s, putting a rope's together first
+static char* lstr_flat(lstr* s) {
+
+	if(s->data) return s->data;
+
+	char* data = malloc(s->len + 1);
+	char* out = data;
+	lstr** stack = malloc(sizeof(lstr*) * (s->depth + 1));  //Every node on it is a child of a different level
+	int top = 0;
+	stack[top++] = s;
+	while(top) {
+		lstr* x = stack[--top];
+		if(x->data) {
+			memcpy(out, x->data, x->len);
+			out += x->len;
+		} else {
+			stack[top++] = x->right;
+			stack[top++] = x->left;
+		}
+	}
+	*out = '\0';
+	free(stack);
+
+	lstr_del(s->left);
+	lstr_del(s->right);
+	s->left = NULL;
+	s->right = NULL;
+	s->data = data;
+	s->depth = 0;
+	return data;
+
+}
+
+//All of v as an lstr of its own, which a rope can hold on to
+static lstr* lstr_piece(lval* v) {
+
+	lstr* s = v->text;
+	s->refs++;
+	if(v->off == 0 && v->len == s->len) return s;
+
+	lstr* view = lstr_node(s, NULL, v->len);
+	view->data = lstr_flat(s) + v->off;
+	return view;
+
+}
+
+//The bytes of v, which are only followed by a NUL if lval_str_cstr() says so
+char* lval_str_chars(lval* v) {
+	return lstr_flat(v->text) + v->off;
+}
+
+//The bytes of v followed by a NUL, copying them out of a longer string if need be
+char* lval_str_cstr(lval* v) {
+
+	char* chars = lval_str_chars(v);
+	if(chars[v->len] == '\0') return chars;  //Every lstr ends with a NUL, so this is always in bounds
+
+	lstr* s = lstr_new(chars, v->len);
+	lstr_del(v->text);
+	v->text = s;
+	v->off = 0;
+	return s->data;
+
+}
+
+unsigned long lval_str_hash(lval* v) {
+
+	if(!v->hash) v->hash = djb2(lval_str_chars(v), v->len);
+	return v->hash;
+
+}
+
+//Concatenate x and y, consuming both; the caller makes sure the result isn't too long
+lval* lval_str_cat(lval* x, lval* y) {
+
+	if(!y->len) {
+		lval_del(y);
+		return x;
+	}
+	if(!x->len) {
+		lval_del(x);
+		return y;
+	}
+
+	int len = x->len + y->len;
+	lstr* s;
+	if(len < LSTR_ROPE_MIN) {
+		s = lstr_new(NULL, len);
+		memcpy(s->data, lval_str_chars(x), x->len);
+		memcpy(s->data + x->len, lval_str_chars(y), y->len);
+	} else {
+		s = lstr_node(lstr_piece(x), lstr_piece(y), len);
+		s->depth = 1 + (s->left->depth > s->right->depth ? s->left->depth : s->right->depth);
+	}
+
+	lval_del(x);
+	lval_del(y);
+	return lval_text(s, 0, len);
+
+}
+
+//The bytes of v from start up to end, which share v's lstr, consuming v
+lval* lval_substr(lval* v, int start, int end) {
+
+	if(start == 0 && end == v->len) return v;
+
+	lstr* s = v->text;
+	s->refs++;
+	lstr_flat(s);  //Only a whole rope can be part of another one, see lstr_piece()
+	lval* x = lval_text(s, v->off + start, end - start);
+	lval_del(v);
+	return x;
+
+}
+
+//Where needle first appears in v at or after from, or -1
+int lval_str_find(lval* v, lval* needle, int from) {
+
+	if(!needle->len) return from;
+	if(needle->len > v->len - from) return -1;
+
+	char* chars = lval_str_chars(v);
+	char* n = lval_str_chars(needle);
+	char* last = chars + v->len - needle->len;  //The last place needle could start
+	for(char* c = chars + from; c <= last; c++) {
+		c = memchr(c, n[0], last - c + 1);
+		if(!c) break;
+		if(memcmp(c + 1, n + 1, needle->len - 1) == 0) return c - chars;
+	}
+	return -1;
+
+}
@@ -0,0 +1,135 @@
+/**
+ * lisp-forty, a lisp interpreter
+ * Copyright (C) 2014-16 Sean Anderson
+ *
+ * This file is part of lisp-forty.
+ *
+ * lisp-forty is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lisp-forty.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stddef.h>
+
+#include "lisp.h"
+
+/* Every distinct symbol name is stored exactly once, in an lsym record that
+ * also holds its hashes. Symbols can then be compared by pointer, and lenvs
+ * never have to hash a name again.
+ */
+
+/* djb2 by Dan Bernstein
+ * This and the next function retrieved from <http://www.cse.yorku.ca/~oz/hash.html> on 6/29/14
+ */
+unsigned long djb2(char* str, size_t len){
+
+	unsigned long hash = 5381;  //Magic starting number
+
+	for(size_t i = 0; i < len; i++)
+		hash = ((hash << 5) + hash) + str[i];  //Multiply by 33 and add c
+
+	return hash;
+}
+
+//Same as above but with different magic numbers
+unsigned long sdbm(char* str, size_t len){
+
+	unsigned long hash = 0;  //Another magic number
+
+	for(size_t i = 0; i < len; i++)
+		hash = ((hash << 6) + (hash << 16) - hash) + str[i];  //Multiply by 65599
+
+	return hash;
+
+}
+
+//The intern table is an open-addressed hash set of lsyms, always a power of 2 in size
+static lsym** lsym_table = NULL;
+static int lsym_max = 0;
+static int lsym_count = 0;
+
+char* LSYM_AMP;
+
+static void lsym_insert(lsym* s) {
+
+	int i = (int) (s->hash & (lsym_max - 1));
+	while(lsym_table[i] != NULL) i = (i + 1) & (lsym_max - 1);  //Linear probe to the next empty slot
+	lsym_table[i] = s;
+
+}
+
+static void lsym_resize(int size) {
+
+	lsym** old = lsym_table;
+	int old_max = lsym_max;
+
+	lsym_table = calloc(size, sizeof(lsym*));
+	lsym_max = size;
+	for(int i = 0; i < old_max; i++)
+		if(old[i] != NULL) lsym_insert(old[i]);
+
+	free(old);
+
+}
+
+void lsym_init() {
+
+	if(lsym_table == NULL) lsym_resize(LSYM_INIT);
+	LSYM_AMP = lsym_intern("&");
+
+}
+
+//Return the canonical copy of name, adding it to the table if it isn't there yet
+char* lsym_intern(char* name) {
+
+	return lsym_intern_n(name, strlen(name));
+
+}
+
+//Same as lsym_intern(), but name is the first len bytes of a longer string
+char* lsym_intern_n(char* name, size_t len) {
+
+	if(lsym_table == NULL) lsym_resize(LSYM_INIT);
+
+	unsigned long hash = djb2(name, len);
+	for(int i = (int) (hash & (lsym_max - 1)); lsym_table[i] != NULL; i = (i + 1) & (lsym_max - 1)) {
+		lsym* other = lsym_table[i];
+		if(other->hash == hash && other->len == len && memcmp(other->name, name, len) == 0) return other->name;
+	}
+
+	if(lsym_count + 1 > lsym_max / 2) lsym_resize(lsym_max * 2);  //Keep the table at most half full
+
+	lsym* s = malloc(sizeof(lsym) + len + 1);
+	s->hash = hash;
+	s->dhash = sdbm(name, len);
+	s->len = len;
+	memcpy(s->name, name, len);
+	s->name[len] = '\0';
+	lsym_insert(s);
+	lsym_count++;
+	return s->name;
+
+}
+
+//Symbols live for as long as the interpreter does, so this is only for shutdown
+void lsym_cleanup() {
+
+	for(int i = 0; i < lsym_max; i++)
+		free(lsym_table[i]);
+	free(lsym_table);
+
+	lsym_table = NULL;
+	lsym_max = 0;
+	lsym_count = 0;
+
+}
@@ -23,25 +23,93 @@
 
 #include <stdbool.h>
 
-#include "mpc.h"
-
 #include "lisp.h"
 
+//Every new lval starts out with just the one reference
+static lval* lval_new(enum ltype type) {
+
+#ifdef LISP_GC_MARK_SWEEP
+	//Only lvals which hold on to memory have to be finalized when the nursery is reset
+	lval* v = lpool_alloc_young(type != LVAL_NUM && type != LVAL_DOUBLE && type != LVAL_SYM && type != LVAL_BOOL);
+#else
+	lval* v = lpool_alloc(&lval_pool);
+#endif
+	v->type = type;
+	v->refs = 1;
+	return v;
+
+}
+
 //Create an lval from a given number
 lval* lval_num(const long num){
 
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_NUM;
+	if(num >= LFIXNUM_MIN && num <= LFIXNUM_MAX) return (lval*) (((uintptr_t) num << 1) | 1);
+
+	lval* v = lval_new(LVAL_NUM);
 	v->num = num;
 	return v;
 
 }
 
+/* A bignum made from nlimbs limbs, which it takes over
+ * Leading zeros are trimmed, and anything that fits in a long is made into a
+ * plain number instead.
+ */
+lval* lval_bignum(bool neg, int nlimbs, uint32_t* limbs) {
+
+	while(nlimbs && !limbs[nlimbs - 1]) nlimbs--;
+
+	if(nlimbs * sizeof(uint32_t) <= sizeof(unsigned long)) {
+		unsigned long u = 0;
+		for(int i = nlimbs - 1; i >= 0; i--) u = (u << 16 << 16) | limbs[i];
+		if(u <= LONG_MAX || (neg && u == (unsigned long) LONG_MAX + 1)) {
+			free(limbs);
+			return lval_num(neg ? (long) (0 - u) : (long) u);
+		}
+	}
+
+	lval* v = lval_new(LVAL_BIGNUM);
+	v->neg = neg;
+	v->nlimbs = nlimbs;
+	v->limbs = limbs;
+	return v;
+
+}
+
+lval* lval_double(double dbl) {
+
+	lval* v = lval_new(LVAL_DOUBLE);
+	v->dbl = dbl;
+	return v;
+
+}
+
+//A vector of the n longs in elems, which it takes over
+lval* lval_vec(int n, long* elems) {
+
+	lval* v = lval_new(LVAL_VEC);
+	v->nelems = n;
+	v->elems = elems;
+	return v;
+
+}
+
+//An empty map, which doesn't get a table until something is put in it
+lval* lval_map() {
+
+	lval* v = lval_new(LVAL_MAP);
+	v->slots = NULL;
+	v->nslots = 0;
+	v->nkeys = 0;
+	v->ndead = 0;
+	return v;
+
+}
+
 //Create an lval from a given error string
 lval* lval_err(char* fmt, ...){
 
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_ERR;
+	lval* v = lval_new(LVAL_ERR);
 
 	va_list va;
 	va_start(va, fmt);
@@ -55,10 +123,25 @@ lval* lval_err(char* fmt, ...){
 
 lval* lval_str(char* str){
 
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_STR;
-	v->str = malloc(strlen(str) + 1);
-	strcpy(v->str, str);
+	return lval_str_n(str, strlen(str));
+
+}
+
+//A str lval from the first len bytes of str
+lval* lval_str_n(char* str, size_t len){
+
+	return lval_text(lstr_new(str, len), 0, len);
+
+}
+
+//A str lval of len bytes of s starting at off, which takes over a reference to s
+lval* lval_text(lstr* s, int off, int len){
+
+	lval* v = lval_new(LVAL_STR);
+	v->text = s;
+	v->hash = 0;
+	v->off = off;
+	v->len = len;
 	return v;
 
 }
@@ -66,10 +149,15 @@ lval* lval_str(char* str){
 //A sym lval from the message
 lval* lval_sym(char* message){
 
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_SYM;
-	v->str = malloc(strlen(message) + 1);
-	strcpy(v->str, message);
+	return lval_sym_n(message, strlen(message));
+
+}
+
+lval* lval_sym_n(char* message, size_t len){
+
+	lval* v = lval_new(LVAL_SYM);
+	v->str = lsym_intern_n(message, len);
+	v->hash = LSYM(v->str)->hash;
 	return v;
 
 }
@@ -77,28 +165,29 @@ lval* lval_sym(char* message){
 //An empty sexp
 lval* lval_sexp(){
 
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_SEXPR;
+	lval* v = lval_new(LVAL_SEXPR);
 	v->count = 0;
 	v->cell = NULL;
+	v->start = v->max = 0;
+	v->owner = NULL;
 	return v;
 
 }
 
 lval* lval_qexpr() {
 
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_QEXPR;
+	lval* v = lval_new(LVAL_QEXPR);
 	v->count = 0;
 	v->cell = NULL;
+	v->start = v->max = 0;
+	v->owner = NULL;
 	return v;
 
 }
 
 lval* lval_func(lbuiltin func){
 
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_FUNC;
+	lval* v = lval_new(LVAL_FUNC);
 	v->builtin = func;
 	return v;
 
@@ -106,18 +195,60 @@ lval* lval_func(lbuiltin func){
 
 lval* lval_lambda(lval* formals, lval* body) {
 
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_FUNC;
+	lval* v = lval_new(LVAL_FUNC);
 	v->builtin = NULL;
-	v->env  = lenv_new(LENV_LOCAL_INIT);
-	v->formals = formals;
-	v->body = body;
+	v->code = lcode_new(formals, body);
+	v->bound = NULL;
+	v->nbound = 0;
 	return v;
 
 }
 
-static lval L_TRUE = {LVAL_BOOL, {true}};
-static lval L_FALSE = {LVAL_BOOL, {false}};
+//Partially apply func, moving the first count args onto the front of what it has bound
+lval* lval_partial(lval* func, lval* args, int count) {
+
+	largs* a = malloc(sizeof(largs) + sizeof(lval*) * count);
+	a->refs = 1;
+	a->prev = func->bound;
+	if(a->prev) a->prev->refs++;
+	a->count = count;
+	memcpy(a->cell, args->cell, sizeof(lval*) * count);
+
+	lval* v = lval_new(LVAL_FUNC);
+	v->builtin = NULL;
+	v->code = func->code;
+	v->code->refs++;
+	v->bound = a;
+	v->nbound = func->nbound + count;
+	return v;
+
+}
+
+void largs_del(largs* a) {
+
+	while(a && --a->refs == 0) {
+		largs* prev = a->prev;
+		for(int i = 0; i < a->count; i++)
+			lval_del(a->cell[i]);
+		free(a);
+		a = prev;
+	}
+
+}
+
+//Line the arguments func has bound up in the order they were passed
+void largs_flatten(lval* func, lval** out) {
+
+	int i = func->nbound;
+	for(largs* a = func->bound; a; a = a->prev) {
+		i -= a->count;
+		memcpy(&out[i], a->cell, sizeof(lval*) * a->count);
+	}
+
+}
+
+static lval L_TRUE = {LVAL_BOOL, 1, {true}};
+static lval L_FALSE = {LVAL_BOOL, 1, {false}};
 lval* LVAL_TRUE = &L_TRUE;
 lval* LVAL_FALSE = &L_FALSE;
 
@@ -131,50 +262,104 @@ lval* lval_bool(int boolean) {
 
 }
 
+//Drop a reference to v, freeing it once nobody is left using it
 void lval_del(lval* v){
 
+#ifdef LISP_GC_MARK_SWEEP
+	UNUSED(v);  //lpool_collect() frees v once nothing can reach it
+#else
+	if(LFIXNUM(v) || v->type == LVAL_BOOL) return;  //Can't free an immutable
+	if(--v->refs > 0) return;
+
+	lval_clear(v);
+	lpool_free(&lval_pool, v);
+#endif
+
+}
+
+//Free everything v holds on to, but not v itself
+void lval_clear(lval* v){
+
 	switch(v->type){
 		case(LVAL_NUM): break;
-		case(LVAL_BOOL): return;  //Can't free an immutable
+		case(LVAL_BOOL): break;
 		case(LVAL_FUNC): if(!v->builtin) {
-			lenv_del(v->env);
-			lval_del(v->formals);
-			lval_del(v->body);
+			largs_del(v->bound);
+			lcode_del(v->code);
 		} break;
-		case(LVAL_STR): free(v->str); break;
+		case(LVAL_STR): lstr_del(v->text); break;
 		case(LVAL_ERR): free(v->str); break;
-		case(LVAL_SYM): free(v->str); break;
+		case(LVAL_SYM): break;  //Interned
+		case(LVAL_BIGNUM): free(v->limbs); break;
+		case(LVAL_DOUBLE): break;
+		case(LVAL_VEC): free(v->elems); break;
+		case(LVAL_MAP): {
+			for(int i = 0; i < v->nslots; i++) {
+				if(!LMAP_FULL(v, i)) continue;
+				lval_del(v->slots[i].key);
+				lval_del(v->slots[i].val);
+			}
+			free(v->slots);
+			break;
+		}
 		case(LVAL_SEXPR):
 		case(LVAL_QEXPR):
+			if(v->owner) {  //The cells are the owner's
+				lval_del(v->owner);
+				break;
+			}
 			for(int i = 0; i < v->count; i++)  //Free the array of lvals
 				lval_del(v->cell[i]);
-			free(v->cell);
+			free(v->cell - v->start);
 			break;
 	}
-	free(v);
+
 }
 
-//Append element to v
+//Append element to v, which must be owned by the caller
 lval* lval_append(lval* v, lval* element){
 
-		v->count++;
-		v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-		v->cell[v->count - 1] = element;
+		lval_reserve(v, v->count + 1);
+		v->cell[v->count++] = element;
 		return v;
 
 }
 
-//Remove an sexpr at index from v and return it
+/* Make sure v, which must be owned by the caller, has room for n cells
+ * The array at least doubles whenever it grows, so appending is amortized O(1).
+ * Space left in front by lval_pop() is only reclaimed once it is half the
+ * array, so popping from the front and appending are both amortized O(1) too.
+ */
+void lval_reserve(lval* v, int n) {
+
+	if(v->start + n <= v->max) return;
+
+	lval** base = v->cell - v->start;
+	if(n > v->max || v->start * 2 < v->max) {
+		int max = v->max * 2;
+		if(max < n) max = n;
+		base = realloc(base, sizeof(lval*) * max);
+		v->cell = base + v->start;
+		v->max = max;
+	}
+	memmove(base, v->cell, sizeof(lval*) * v->count);
+	v->cell = base;
+	v->start = 0;
+
+}
+
+//Remove an sexpr at index from v and return it, v must be owned by the caller
 lval* lval_pop(lval* v, int index) {
 
 	lval* pop = v->cell[index];
 
-	//Copy over the space pop was using
-	memmove(&v->cell[index], &v->cell[index+1], sizeof(lval*) * (v->count-index-1));
-
 	v->count--;
-	//Resize the array
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+	if(index == 0) {  //Just step over it, lval_reserve() gets the space back later
+		v->cell++;
+		v->start++;
+	} else {  //Copy over the space pop was using
+		memmove(&v->cell[index], &v->cell[index+1], sizeof(lval*) * (v->count-index));
+	}
 	return pop;
 
 }
@@ -182,38 +367,105 @@ lval* lval_pop(lval* v, int index) {
 //Get rid of v and return the element at index
 lval* lval_take(lval* v, int index){
 
+	if(v->refs > 1 || LSLICE(v)) {  //Leave v alone for whoever else is using it
+		lval* x = lval_copy(v->cell[index]);
+		lval_del(v);
+		return x;
+	}
+
 	lval* pop = lval_pop(v, index);
 	lval_del(v);
 	return pop;
 }
 
+/* A list of the cells of l from start up to end, in O(1) if possible
+ * The slice points into the array of the list which really holds the cells,
+ * and keeps a reference to it. Since that array can't be freed while the slice
+ * is around, only slices holding at least half of it share it: repeatedly
+ * taking the tail of a list copies it about log n times, and at most twice as
+ * many cells as are reachable are kept alive.
+ */
+lval* lval_slice(lval* l, int start, int end) {
+
+	lval* owner = l->owner ? l->owner : l;
+	int count = end - start;
+
+	lval* x = l->type == LVAL_SEXPR ? lval_sexp() : lval_qexpr();
+	if(count < LVAL_SLICE_MIN || count * 2 < owner->count) {
+		lval_reserve(x, count);
+		for(int i = start; i < end; i++)
+			x->cell[x->count++] = lval_copy(l->cell[i]);
+		return x;
+	}
+
+	x->owner = lval_copy(owner);
+	x->cell = l->cell + start;
+	x->count = count;
+	return x;
+
+}
+
 //Tests to see if two lvals are equal (identical)
 lval* lval_equals(lval* x, lval* y) {
 
 	if(x == y) return LVAL_TRUE;  //This takes care of booleans, since immutibility
-	if(x->type != y->type) return LVAL_FALSE;  //TODO: should we error on this?
+	if(LTYPE(x) != LTYPE(y)) return LVAL_FALSE;  //TODO: should we error on this?
 
-	switch(x->type) {
+	switch(LTYPE(x)) {
 		case(LVAL_BOOL):
 			break;
 		case(LVAL_NUM): 
-			if(x->num == y->num) return LVAL_TRUE; 
+			if(LNUM(x) == LNUM(y)) return LVAL_TRUE; 
+			break;
+		case(LVAL_BIGNUM):
+			if(x->neg == y->neg && x->nlimbs == y->nlimbs &&
+			   memcmp(x->limbs, y->limbs, sizeof(uint32_t) * x->nlimbs) == 0) return LVAL_TRUE;
+			break;
+		case(LVAL_DOUBLE):
+			if(x->dbl == y->dbl) return LVAL_TRUE;
 			break;
+		case(LVAL_VEC):
+			if(x->nelems == y->nelems &&
+			   memcmp(x->elems, y->elems, sizeof(long) * x->nelems) == 0) return LVAL_TRUE;
+			break;
+		case(LVAL_MAP): {
+			if(x->nkeys != y->nkeys) break;
+			for(int i = 0; i < x->nslots; i++) {
+				if(!LMAP_FULL(x, i)) continue;
+				lval* val = lmap_get(y, x->slots[i].key);
+				if(!val || lval_equals(x->slots[i].val, val) == LVAL_FALSE) return LVAL_FALSE;
+			}
+			return LVAL_TRUE;
+		}
 		case(LVAL_FUNC): if(x->builtin) {
 			if(x->builtin == y->builtin) return LVAL_TRUE;
 				break;
 			} else {
-				if((lenv_equals(x->env, y->env) == LVAL_TRUE) &&
-				   (lval_equals(x->formals, y->formals) == LVAL_TRUE) &&
-				   (lval_equals(x->body, y->body) == LVAL_TRUE))
-					return LVAL_TRUE;
-				break;
+				if(y->builtin || x->nbound != y->nbound) break;
+				if(x->code != y->code &&
+				   ((lval_equals(x->code->formals, y->code->formals) == LVAL_FALSE) ||
+				    (lval_equals(x->code->body, y->code->body) == LVAL_FALSE)))
+					break;
+
+				lval* xs[x->nbound + 1];
+				lval* ys[y->nbound + 1];
+				largs_flatten(x, xs);
+				largs_flatten(y, ys);
+				for(int i = 0; i < x->nbound; i++)
+					if(lval_equals(xs[i], ys[i]) == LVAL_FALSE) return LVAL_FALSE;
+				return LVAL_TRUE;
 			}
-		case(LVAL_ERR):
 		case(LVAL_SYM):
-		case(LVAL_STR):
+			if(x->str == y->str) return LVAL_TRUE;  //Interned
+			break;
+		case(LVAL_ERR):
 			if(strcmp(x->str, y->str) == 0) return LVAL_TRUE;
 			break;
+		case(LVAL_STR):
+			if(x->len != y->len || (x->hash && y->hash && x->hash != y->hash)) break;
+			if(x->text == y->text && x->off == y->off) return LVAL_TRUE;
+			if(memcmp(lval_str_chars(x), lval_str_chars(y), x->len) == 0) return LVAL_TRUE;
+			break;
 		case(LVAL_QEXPR):
 		case(LVAL_SEXPR):
 			if(x->count != y->count) break;
@@ -226,112 +478,286 @@ lval* lval_equals(lval* x, lval* y) {
 
 }
 
+//x must be owned by the caller
 lval* lval_join(lval* x, lval* y) {
 
 	//Add all the cells in y to x
-	while(y->count) x = lval_append(x, lval_pop(y, 0));
+	if(y->refs == 1 && !LSLICE(y)) {
+		while(y->count) x = lval_append(x, lval_pop(y, 0));
+	} else {  //Somebody else can still see y, so share its cells instead
+		for(int i = 0; i < y->count; i++) x = lval_append(x, lval_copy(y->cell[i]));
+	}
 
 	lval_del(y);
 	return x;
 
 }
 
+/* lvals are immutable once they're shared, so copying one is just taking
+ * another reference to it. Anything that wants to change an lval has to
+ * lval_own() it first.
+ */
 lval* lval_copy(lval* v) {
 
-	lval* x = malloc(sizeof(lval));
-	x->type = v->type;
+#ifdef LISP_GC_MARK_SWEEP
+	if(!LFIXNUM(v) && v->type != LVAL_BOOL) v->refs = 2;  //Nobody counts references, so once shared always shared
+#else
+	if(!LFIXNUM(v) && v->type != LVAL_BOOL) v->refs++;  //Fixnums and booleans are immutable
+#endif
+	return v;
+
+}
+
+/* Take v over so it can be changed
+ * If anybody else has a reference to v we make our own shallow copy, which
+ * shares all of v's children, and give up our reference to v.
+ */
+lval* lval_own(lval* v) {
+
+	if(LFIXNUM(v) || v->type == LVAL_BOOL || (v->refs == 1 && !LSLICE(v))) return v;
+
+	lval* x = lval_new(v->type);
 
 	switch(v->type) {
 		case(LVAL_NUM): x->num = v->num; break;
-		case(LVAL_BOOL): free(x); return v;
+		case(LVAL_BIGNUM):
+			x->neg = v->neg;
+			x->nlimbs = v->nlimbs;
+			x->limbs = malloc(sizeof(uint32_t) * v->nlimbs);
+			memcpy(x->limbs, v->limbs, sizeof(uint32_t) * v->nlimbs);
+			break;
+		case(LVAL_DOUBLE): x->dbl = v->dbl; break;
+		case(LVAL_VEC):
+			x->nelems = v->nelems;
+			x->elems = lvec_alloc(v->nelems);
+			memcpy(x->elems, v->elems, sizeof(long) * (size_t) v->nelems);
+			break;
+		case(LVAL_MAP): lmap_clone(x, v, lval_copy); break;
+		case(LVAL_BOOL): break;
 		case(LVAL_FUNC): if(v->builtin) {
 			x->builtin = v->builtin;
 		} else {
 			x->builtin = NULL;
-			x->env = lenv_copy(v->env);
-			x->formals = lval_copy(v->formals);
-			x->body = lval_copy(v->body);
+			x->code = v->code;
+			x->code->refs++;
+			x->bound = v->bound;
+			if(x->bound) x->bound->refs++;
+			x->nbound = v->nbound;
 		} break;
 		case(LVAL_ERR): x->str = malloc(strlen(v->str) + 1); strcpy(x->str, v->str); break;
-		case(LVAL_SYM): x->str = malloc(strlen(v->str) + 1); strcpy(x->str, v->str); break;
-		case(LVAL_STR): x->str = malloc(strlen(v->str) + 1); strcpy(x->str, v->str); break;
+		case(LVAL_SYM): x->str = v->str; x->hash = v->hash; break;
+		case(LVAL_STR):
+			x->text = v->text;
+			x->text->refs++;
+			x->hash = v->hash;
+			x->off = v->off;
+			x->len = v->len;
+			break;
 		case(LVAL_SEXPR):
 		case(LVAL_QEXPR):
 			x->count = v->count;
 			x->cell = malloc(sizeof(lval*) * v->count);
+			x->start = 0;
+			x->max = v->count;
+			x->owner = NULL;
 			for(int i = 0; i < v->count; i++)
 				x->cell[i] = lval_copy(v->cell[i]);
 			break;
 	}
 
+	lval_del(v);  //Which frees a slice nobody else had
 	return x;
 }
 
-void lval_print(lval* v){
+#ifdef LISP_GC_MARK_SWEEP
+/* Copy v, and everything it holds, out of the nursery
+ * The copy is filled in a piece at a time so the collector never sees garbage
+ * in it. Lambdas share their lcode and largs, so those get promoted in place.
+ */
+lval* lval_promote(lval* v) {
 
-	switch(v->type){
+	if(LFIXNUM(v) || v->type == LVAL_BOOL || !lpool_young(v)) return v;  //Nothing old points into the nursery
+
+	lval* x = lpool_alloc(&lval_pool);
+	x->type = v->type;
+	x->refs = 2;  //Shared with whatever still has v
+
+	switch(v->type) {
+		case(LVAL_NUM): x->num = v->num; break;
+		case(LVAL_BIGNUM):
+			x->neg = v->neg;
+			x->nlimbs = v->nlimbs;
+			x->limbs = malloc(sizeof(uint32_t) * v->nlimbs);
+			memcpy(x->limbs, v->limbs, sizeof(uint32_t) * v->nlimbs);
+			break;
+		case(LVAL_DOUBLE): x->dbl = v->dbl; break;
+		case(LVAL_VEC):
+			x->nelems = v->nelems;
+			x->elems = lvec_alloc(v->nelems);
+			memcpy(x->elems, v->elems, sizeof(long) * (size_t) v->nelems);
+			break;
+		case(LVAL_MAP): lmap_clone(x, v, lval_promote); break;
+		case(LVAL_BOOL): break;
+		case(LVAL_FUNC): if(v->builtin) {
+			x->builtin = v->builtin;
+		} else {
+			x->builtin = NULL;
+			x->code = v->code;
+			x->code->refs++;
+			x->bound = v->bound;
+			if(x->bound) x->bound->refs++;
+			x->nbound = v->nbound;
+
+			lcode* c = x->code;
+			c->formals = lval_promote(c->formals);
+			c->body = lval_promote(c->body);
+			for(int i = 0; i < c->nconsts; i++)
+				c->consts[i] = lval_promote(c->consts[i]);
+			for(largs* a = x->bound; a; a = a->prev)
+				for(int i = 0; i < a->count; i++)
+					a->cell[i] = lval_promote(a->cell[i]);
+		} break;
+		case(LVAL_ERR): x->str = malloc(strlen(v->str) + 1); strcpy(x->str, v->str); break;
+		case(LVAL_SYM): x->str = v->str; x->hash = v->hash; break;
+		case(LVAL_STR):
+			x->text = v->text;
+			x->text->refs++;
+			x->hash = v->hash;
+			x->off = v->off;
+			x->len = v->len;
+			break;
+		case(LVAL_SEXPR):
+		case(LVAL_QEXPR):
+			x->count = 0;
+			x->cell = malloc(sizeof(lval*) * v->count);
+			x->start = 0;
+			x->max = v->count;
+			x->owner = NULL;  //Only the cells this needs are promoted
+			for(int i = 0; i < v->count; i++) {
+				lval* y = lval_promote(v->cell[i]);
+				x->cell[x->count++] = y;
+			}
+			break;
+	}
+
+	return x;
+
+}
+#endif
+
+void lval_print(lbuf* b, lval* v){
+
+	switch(LTYPE(v)){
 		case(LVAL_BOOL):
 			if(v == LVAL_TRUE) {
-				printf("true");
+				lbuf_puts(b, "true");
 			} else {
-				printf("false"); 
+				lbuf_puts(b, "false");
 			}
 			break;
 		case(LVAL_NUM):
-			printf("%li", v->num);
+			lbuf_num(b, LNUM(v));
+			break;
+		case(LVAL_BIGNUM):
+		case(LVAL_DOUBLE):
+			lnum_print(b, v);
 			break;
+		case(LVAL_VEC):
+			lbuf_putc(b, '[');
+			for(int i = 0; i < v->nelems; i++) {
+				if(i) lbuf_putc(b, ' ');
+				lbuf_num(b, v->elems[i]);
+			}
+			lbuf_putc(b, ']');
+			break;
+		case(LVAL_MAP): {
+			lbuf_puts(b, "<map");
+			for(int i = 0; i < v->nslots; i++) {
+				if(!LMAP_FULL(v, i)) continue;
+				lbuf_putc(b, ' '); lval_print(b, v->slots[i].key);
+				lbuf_putc(b, ' '); lval_print(b, v->slots[i].val);
+			}
+			lbuf_putc(b, '>');
+			break;
+		}
 		case(LVAL_ERR):
-			printf("Error: %s", v->str);
+			lbuf_puts(b, "Error: "); lbuf_puts(b, v->str);
 			break;
 		case(LVAL_SYM):
-			printf("%s", v->str);
+			lbuf_write(b, v->str, LSYM(v->str)->len);
 			break;
 		case(LVAL_STR):
-			lval_str_print(v);
+			lval_str_print(b, v);
 			break;
 		case(LVAL_FUNC):
 			if(v->builtin) {
-				printf("<builtin>");
+				lbuf_puts(b, "<builtin>");
 			} else {
-				printf("(\\ "); lval_print(v->formals);
-				putchar(' ');
-				lval_print(v->body); putchar(')');
+				//Only the formals that haven't been bound yet
+				lval* formals = v->code->formals;
+				lval rest = {LVAL_QEXPR, 1, {.count = formals->count - v->nbound}};
+				rest.cell = &formals->cell[v->nbound];
+
+				lbuf_puts(b, "(\\ "); lval_print(b, &rest);
+				lbuf_putc(b, ' ');
+				lval_print(b, v->code->body); lbuf_putc(b, ')');
 			}
 			break;
 		case(LVAL_SEXPR):
-			lval_expr_print(v, '(', ')');
+			lval_expr_print(b, v, '(', ')');
 			break;
 		case(LVAL_QEXPR):
-			lval_expr_print(v, '{', '}');
+			lval_expr_print(b, v, '{', '}');
 			break;
 	}
 
 }
 
-void lval_expr_print(lval* v, char open, char close){
+void lval_expr_print(lbuf* b, lval* v, char open, char close){
 
-	putchar(open);
+	lbuf_putc(b, open);
 	for(int i = 0; i < v->count; i++){
 		//Print the value
-		lval_print(v->cell[i]);
+		lval_print(b, v->cell[i]);
 		//Only put a space if it's not last
-		if(i != (v->count - 1)) putchar(' ');
+		if(i != (v->count - 1)) lbuf_putc(b, ' ');
 	}
-	putchar(close);
+	lbuf_putc(b, close);
 
 }
 
-void lval_str_print(lval* v){
-
-	char* escaped = malloc(strlen(v->str) + 1);
-	strcpy(escaped, v->str);
-
-	escaped = mpcf_escape(escaped);
-	printf("\"%s\"", escaped);
-	free(escaped);
+//Print a string with the same escapes lread() understands
+void lval_str_print(lbuf* b, lval* v){
+
+	lbuf_putc(b, '"');
+	char* run = lval_str_chars(v);  //Characters which don't need escaping are written all at once
+	char* end = run + v->len;
+	char* c;
+	for(c = run; c < end; c++) {
+		char* esc;
+		switch(*c) {
+			case '\0': esc = "\\0"; break;
+			case '\a': esc = "\\a"; break;
+			case '\b': esc = "\\b"; break;
+			case '\f': esc = "\\f"; break;
+			case '\n': esc = "\\n"; break;
+			case '\r': esc = "\\r"; break;
+			case '\t': esc = "\\t"; break;
+			case '\v': esc = "\\v"; break;
+			case '\\': esc = "\\\\"; break;
+			case '\'': esc = "\\'"; break;
+			case '"': esc = "\\\""; break;
+			default: continue;
+		}
+		lbuf_write(b, run, c - run);
+		lbuf_write(b, esc, 2);
+		run = c + 1;
+	}
+	lbuf_write(b, run, c - run);
+	lbuf_putc(b, '"');
 
 }
 
-void lval_println(lval* v){
-	lval_print(v); putchar('\n');
+void lval_println(lbuf* b, lval* v){
+	lval_print(b, v); lbuf_putc(b, '\n');
 }
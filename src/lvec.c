@@ -0,0 +1,429 @@
+/**
+ * lisp-forty, a lisp interpreter
+ * Copyright (C) 2014-16 Sean Anderson
+ *
+ * This file is part of lisp-forty.
+ *
+ * lisp-forty is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lisp-forty.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lisp.h"
+
+/* Packed integer vectors
+ * A vector is a plain array of longs, so the bulk builtins can run over it
+ * without touching an lval per element. The kernels that are worth it have an
+ * AVX2 version, which lvec_init() picks if the CPU has it. Everything else,
+ * and every other CPU, gets the plain C versions.
+ * Kernels which can overflow say so instead of wrapping, and the caller either
+ * redoes the work exactly with bignums or gives up with an error.
+ */
+
+#if defined(__GNUC__) && defined(__x86_64__) && __SIZEOF_LONG__ == 8
+#define LVEC_AVX2
+#include <immintrin.h>
+#endif
+
+/* Plain C kernels */
+
+static bool lvec_sum_c(const long* x, int n, long* out) {
+
+	//Unsigned, so wrapping is defined; an overflow leaves the sign bit in ovf
+	unsigned long acc = 0, ovf = 0;
+	for(int i = 0; i < n; i++) {
+		unsigned long r = acc + (unsigned long) x[i];
+		ovf |= (acc ^ r) & ((unsigned long) x[i] ^ r);
+		acc = r;
+	}
+	if(ovf >> (sizeof(long) * CHAR_BIT - 1)) return false;
+	*out = (long) acc;
+	return true;
+
+}
+
+static long lvec_min_c(const long* x, int n) {
+
+	long m = x[0];
+	for(int i = 1; i < n; i++)
+		if(x[i] < m) m = x[i];
+	return m;
+
+}
+
+static long lvec_max_c(const long* x, int n) {
+
+	long m = x[0];
+	for(int i = 1; i < n; i++)
+		if(x[i] > m) m = x[i];
+	return m;
+
+}
+
+//y is NULL to use k for every element
+static bool lvec_add_c(const long* x, const long* y, long k, long* out, int n) {
+
+	unsigned long ovf = 0;
+	for(int i = 0; i < n; i++) {
+		unsigned long a = (unsigned long) x[i], b = (unsigned long) (y ? y[i] : k);
+		unsigned long r = a + b;
+		ovf |= (a ^ r) & (b ^ r);
+		out[i] = (long) r;
+	}
+	return !(ovf >> (sizeof(long) * CHAR_BIT - 1));
+
+}
+
+static bool lvec_mul_c(const long* x, const long* y, long k, long* out, int n) {
+
+	for(int i = 0; i < n; i++)
+		if(__builtin_mul_overflow(x[i], y ? y[i] : k, &out[i])) return false;
+	return true;
+
+}
+
+static bool lvec_dot_c(const long* x, const long* y, int n, long* out) {
+
+	long acc = 0;
+	for(int i = 0; i < n; i++) {
+		long t;
+		if(__builtin_mul_overflow(x[i], y[i], &t) || __builtin_add_overflow(acc, t, &acc)) return false;
+	}
+	*out = acc;
+	return true;
+
+}
+
+//Sets out to 1 where the relation holds and 0 where it doesn't
+static void lvec_compare_c(rel op, const long* x, const long* y, long k, long* out, int n) {
+
+	switch(op) {
+		case(REL_LT): for(int i = 0; i < n; i++) out[i] = x[i] < (y ? y[i] : k); break;
+		case(REL_GT): for(int i = 0; i < n; i++) out[i] = x[i] > (y ? y[i] : k); break;
+		default: for(int i = 0; i < n; i++) out[i] = x[i] == (y ? y[i] : k); break;
+	}
+
+}
+
+/* AVX2 kernels
+ * Four longs to a register. AVX2 can't multiply 64-bit integers, but it can
+ * multiply the low 32 bits of each lane into a full 64-bit product, so the
+ * multiplying kernels use that and fall back to the plain C kernels if any
+ * element turns out not to fit in 32 bits.
+ */
+
+#ifdef LVEC_AVX2
+#define LVEC_TARGET __attribute__((target("avx2")))
+#define LVEC_LOAD(p) _mm256_loadu_si256((const __m256i*) (p))
+#define LVEC_STORE(p, v) _mm256_storeu_si256((__m256i*) (p), (v))
+//The lanes of v whose sign bits are set
+#define LVEC_SIGNS(v) _mm256_movemask_pd(_mm256_castsi256_pd(v))
+
+//The sign bit of each lane is set if a + b overflowed into r
+LVEC_TARGET static inline __m256i lvec_overflow(__m256i a, __m256i b, __m256i r) {
+
+	return _mm256_and_si256(_mm256_xor_si256(a, r), _mm256_xor_si256(b, r));
+
+}
+
+/* Lanes which fit in 32 bits have nothing in their top halves once 2^31 is
+ * added, so ORing that into wide for every input and checking it once at the
+ * end says whether _mm256_mul_epi32() was good enough for all of them
+ */
+LVEC_TARGET static inline __m256i lvec_widen(__m256i wide, __m256i v) {
+
+	return _mm256_or_si256(wide, _mm256_add_epi64(v, _mm256_set1_epi64x((long long) 1 << 31)));
+
+}
+
+LVEC_TARGET static inline bool lvec_fits32(__m256i wide) {
+
+	return _mm256_testz_si256(wide, _mm256_set1_epi64x(-(1LL << 32)));
+
+}
+
+LVEC_TARGET static bool lvec_sum_avx2(const long* x, int n, long* out) {
+
+	__m256i acc = _mm256_setzero_si256(), ovf = _mm256_setzero_si256();
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m256i v = LVEC_LOAD(x + i);
+		__m256i r = _mm256_add_epi64(acc, v);
+		ovf = _mm256_or_si256(ovf, lvec_overflow(acc, v, r));
+		acc = r;
+	}
+	if(LVEC_SIGNS(ovf)) return false;
+
+	long lanes[4];
+	LVEC_STORE(lanes, acc);
+	long s = 0;
+	for(int j = 0; j < 4; j++)
+		if(__builtin_add_overflow(s, lanes[j], &s)) return false;
+	for(; i < n; i++)
+		if(__builtin_add_overflow(s, x[i], &s)) return false;
+	*out = s;
+	return true;
+
+}
+
+LVEC_TARGET static long lvec_minmax_avx2(const long* x, int n, bool max) {
+
+	long m = x[0];
+	int i = 0;
+	if(n >= 4) {
+		__m256i acc = LVEC_LOAD(x);
+		for(i = 4; i + 4 <= n; i += 4) {
+			__m256i v = LVEC_LOAD(x + i);
+			__m256i better = max ? _mm256_cmpgt_epi64(v, acc) : _mm256_cmpgt_epi64(acc, v);
+			acc = _mm256_blendv_epi8(acc, v, better);
+		}
+		long lanes[4];
+		LVEC_STORE(lanes, acc);
+		m = max ? lvec_max_c(lanes, 4) : lvec_min_c(lanes, 4);
+	}
+	for(; i < n; i++)
+		if(max ? x[i] > m : x[i] < m) m = x[i];
+	return m;
+
+}
+
+LVEC_TARGET static long lvec_min_avx2(const long* x, int n) { return lvec_minmax_avx2(x, n, false); }
+LVEC_TARGET static long lvec_max_avx2(const long* x, int n) { return lvec_minmax_avx2(x, n, true); }
+
+LVEC_TARGET static bool lvec_add_avx2(const long* x, const long* y, long k, long* out, int n) {
+
+	__m256i ovf = _mm256_setzero_si256();
+	__m256i b = _mm256_set1_epi64x(k);
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m256i a = LVEC_LOAD(x + i);
+		if(y) b = LVEC_LOAD(y + i);
+		__m256i r = _mm256_add_epi64(a, b);
+		ovf = _mm256_or_si256(ovf, lvec_overflow(a, b, r));
+		LVEC_STORE(out + i, r);
+	}
+	if(LVEC_SIGNS(ovf)) return false;
+	return lvec_add_c(x + i, y ? y + i : NULL, k, out + i, n - i);
+
+}
+
+LVEC_TARGET static bool lvec_mul_avx2(const long* x, const long* y, long k, long* out, int n) {
+
+	if(!y && (k < INT32_MIN || k > INT32_MAX)) return lvec_mul_c(x, y, k, out, n);
+
+	__m256i wide = _mm256_setzero_si256();
+	__m256i b = _mm256_set1_epi64x(k);
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m256i a = LVEC_LOAD(x + i);
+		wide = lvec_widen(wide, a);
+		if(y) {
+			b = LVEC_LOAD(y + i);
+			wide = lvec_widen(wide, b);
+		}
+		LVEC_STORE(out + i, _mm256_mul_epi32(a, b));
+	}
+	if(!lvec_fits32(wide)) return lvec_mul_c(x, y, k, out, n);  //Start again the slow way
+	return lvec_mul_c(x + i, y ? y + i : NULL, k, out + i, n - i);
+
+}
+
+LVEC_TARGET static bool lvec_dot_avx2(const long* x, const long* y, int n, long* out) {
+
+	__m256i acc = _mm256_setzero_si256(), ovf = _mm256_setzero_si256(), wide = _mm256_setzero_si256();
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m256i a = LVEC_LOAD(x + i), b = LVEC_LOAD(y + i);
+		wide = lvec_widen(lvec_widen(wide, a), b);
+		__m256i p = _mm256_mul_epi32(a, b);
+		__m256i r = _mm256_add_epi64(acc, p);
+		ovf = _mm256_or_si256(ovf, lvec_overflow(acc, p, r));
+		acc = r;
+	}
+	if(!lvec_fits32(wide) || LVEC_SIGNS(ovf)) return lvec_dot_c(x, y, n, out);
+
+	long lanes[4], s;
+	LVEC_STORE(lanes, acc);
+	if(!lvec_dot_c(x + i, y + i, n - i, &s)) return false;
+	for(int j = 0; j < 4; j++)
+		if(__builtin_add_overflow(s, lanes[j], &s)) return false;
+	*out = s;
+	return true;
+
+}
+
+LVEC_TARGET static void lvec_compare_avx2(rel op, const long* x, const long* y, long k, long* out, int n) {
+
+	__m256i one = _mm256_set1_epi64x(1);
+	__m256i b = _mm256_set1_epi64x(k);
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m256i a = LVEC_LOAD(x + i);
+		if(y) b = LVEC_LOAD(y + i);
+		__m256i m;
+		switch(op) {
+			case(REL_LT): m = _mm256_cmpgt_epi64(b, a); break;
+			case(REL_GT): m = _mm256_cmpgt_epi64(a, b); break;
+			default: m = _mm256_cmpeq_epi64(a, b); break;
+		}
+		LVEC_STORE(out + i, _mm256_and_si256(m, one));
+	}
+	lvec_compare_c(op, x + i, y ? y + i : NULL, k, out + i, n - i);
+
+}
+
+#undef LVEC_TARGET
+#undef LVEC_LOAD
+#undef LVEC_STORE
+#undef LVEC_SIGNS
+#endif
+
+/* Dispatch */
+
+static struct {
+	bool (*sum)(const long*, int, long*);
+	long (*min)(const long*, int);
+	long (*max)(const long*, int);
+	bool (*add)(const long*, const long*, long, long*, int);
+	bool (*mul)(const long*, const long*, long, long*, int);
+	bool (*dot)(const long*, const long*, int, long*);
+	void (*compare)(rel, const long*, const long*, long, long*, int);
+} lvec_kernels = {lvec_sum_c, lvec_min_c, lvec_max_c, lvec_add_c, lvec_mul_c, lvec_dot_c, lvec_compare_c};
+
+//Use the fastest kernels this CPU can run, unless simd is false
+void lvec_init(bool simd) {
+
+#ifdef LVEC_AVX2
+	__builtin_cpu_init();
+	if(simd && __builtin_cpu_supports("avx2")) {
+		lvec_kernels.sum = lvec_sum_avx2;
+		lvec_kernels.min = lvec_min_avx2;
+		lvec_kernels.max = lvec_max_avx2;
+		lvec_kernels.add = lvec_add_avx2;
+		lvec_kernels.mul = lvec_mul_avx2;
+		lvec_kernels.dot = lvec_dot_avx2;
+		lvec_kernels.compare = lvec_compare_avx2;
+	}
+#else
+	UNUSED(simd);
+#endif
+
+}
+
+/* Builtins
+ * The builtins in main.c check their arguments, so everything here can assume
+ * it was given vectors of the right length.
+ */
+
+//Apply op to x and y and delete them
+static lval* lvec_step(arith op, lval* x, lval* y) {
+
+	lval* r = lnum_arith(op, x, y);
+	lval_del(x);
+	lval_del(y);
+	return r;
+
+}
+
+/* Add up x, multiply it out, or add up the products of x and y, exactly
+ * This is only for when the kernel overflows. Longs are used for as long as
+ * they hold out, and then added or multiplied into a bignum.
+ */
+static lval* lvec_exact(arith op, const long* x, const long* y, int n) {
+
+	long acc = op == ARITH_MUL;
+	lval* big = lval_num(acc);
+	for(int i = 0; i < n && LTYPE(big) != LVAL_ERR; i++) {
+		long t = x[i], r;
+		if(y && __builtin_mul_overflow(x[i], y[i], &t)) {
+			big = lvec_step(ARITH_ADD, big, lvec_step(ARITH_MUL, lval_num(x[i]), lval_num(y[i])));
+			continue;
+		}
+		if(op == ARITH_MUL ? __builtin_mul_overflow(acc, t, &r) : __builtin_add_overflow(acc, t, &r)) {
+			big = lvec_step(op, big, lval_num(acc));
+			acc = t;
+		} else acc = r;
+	}
+	if(LTYPE(big) == LVAL_ERR) return big;
+	return lvec_step(op, big, lval_num(acc));
+
+}
+
+//Add, multiply, or find the least or greatest of the elements of v
+lval* lvec_fold(arith op, lval* v) {
+
+	long r;
+	switch(op) {
+		case(ARITH_ADD):
+			if(lvec_kernels.sum(v->elems, v->nelems, &r)) return lval_num(r);
+			return lvec_exact(op, v->elems, NULL, v->nelems);
+		case(ARITH_MUL):
+			r = 1;
+			for(int i = 0; i < v->nelems; i++)
+				if(__builtin_mul_overflow(r, v->elems[i], &r)) return lvec_exact(op, v->elems, NULL, v->nelems);
+			return lval_num(r);
+		case(ARITH_MIN): return lval_num(lvec_kernels.min(v->elems, v->nelems));
+		case(ARITH_MAX): return lval_num(lvec_kernels.max(v->elems, v->nelems));
+		default: return lval_err("Not a vector function!");
+	}
+
+}
+
+lval* lvec_dot(lval* x, lval* y) {
+
+	long r;
+	if(lvec_kernels.dot(x->elems, y->elems, x->nelems, &r)) return lval_num(r);
+	return lvec_exact(ARITH_ADD, x->elems, y->elems, x->nelems);
+
+}
+
+/* Room for n elements
+ * n comes from an int count, so it's checked before it becomes a size_t.
+ * Empty vectors still get a pointer of their own.
+ */
+long* lvec_alloc(int n) {
+
+	return malloc(sizeof(long) * (n > 0 ? (size_t) n : 1));
+
+}
+
+//Add or multiply each element of x by the same element of y, or by y if it's a number
+lval* lvec_map(arith op, lval* x, lval* y) {
+
+	long* out = lvec_alloc(x->nelems);
+	long* ys = LTYPE(y) == LVAL_VEC ? y->elems : NULL;
+	long k = ys ? 0 : LNUM(y);
+	bool ok;
+	switch(op) {
+		case(ARITH_ADD): ok = lvec_kernels.add(x->elems, ys, k, out, x->nelems); break;
+		case(ARITH_MUL): ok = lvec_kernels.mul(x->elems, ys, k, out, x->nelems); break;
+		default:
+			free(out);
+			return lval_err("Not a vector function!");
+	}
+	if(!ok) {
+		free(out);
+		return lval_err("Integer overflow in vector %s", op == ARITH_ADD ? "addition" : "multiplication");
+	}
+	return lval_vec(x->nelems, out);
+
+}
+
+//A vector of 1 where op holds between x and y (or the number y), and 0 elsewhere
+lval* lvec_compare(rel op, lval* x, lval* y) {
+
+	long* out = lvec_alloc(x->nelems);
+	long* ys = LTYPE(y) == LVAL_VEC ? y->elems : NULL;
+	lvec_kernels.compare(op, x->elems, ys, ys ? 0 : LNUM(y), out, x->nelems);
+	return lval_vec(x->nelems, out);
+
+}
@@ -0,0 +1,343 @@
+/**
+ * lisp-forty, a lisp interpreter
+ * Copyright (C) 2014-16 Sean Anderson
+ *
+ * This file is part of lisp-forty.
+ *
+ * lisp-forty is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Foobar is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with lisp-forty.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "lisp.h"
+
+/* A small stack-based bytecode VM for lambda bodies
+ *
+ * The first time a lambda is called its body is compiled into an lcode, which
+ * is shared by every copy of the lambda. Formals are resolved to their slots in
+ * the frame each call binds them in, constants are pulled out ahead of time, and
+ * (if c {a} {b}) becomes a conditional jump as long as if is still the
+ * builtin. Calls go back through lval_apply(), and calls in tail position are
+ * handed back to lval_eval() so that tail calls still don't grow the C stack.
+ */
+
+bool lvm_enabled = true;
+
+//Takes over formals and body
+lcode* lcode_new(lval* formals, lval* body) {
+
+	lcode* c = malloc(sizeof(lcode));
+	c->refs = 1;
+	c->compiled = false;
+	c->formals = formals;
+	c->body = body;
+
+	c->nformals = 0;
+	c->locals = malloc(sizeof(char*) * formals->count);
+	for(int i = 0; i < formals->count; i++)
+		if(formals->cell[i]->str != LSYM_AMP) c->locals[c->nformals++] = formals->cell[i]->str;
+
+	c->count = 0;
+	c->ops = NULL;
+	c->nconsts = 0;
+	c->consts = NULL;
+	c->sp = 0;
+	c->depth = 0;
+	return c;
+
+}
+
+void lcode_del(lcode* c) {
+
+	if(--c->refs > 0) return;
+
+	for(int i = 0; i < c->nconsts; i++)
+		lval_del(c->consts[i]);
+	free(c->consts);
+	free(c->locals);
+	lval_del(c->formals);
+	lval_del(c->body);
+	free(c->ops);
+	free(c);
+
+}
+
+//Emit a single word and return its position
+static int lvm_emit(lcode* c, int word) {
+
+	c->ops = realloc(c->ops, sizeof(int) * (c->count + 1));
+	c->ops[c->count] = word;
+	return c->count++;
+
+}
+
+//Add a copy of v to the constant pool
+static int lvm_const(lcode* c, lval* v) {
+
+	c->consts = realloc(c->consts, sizeof(lval*) * (c->nconsts + 1));
+	c->consts[c->nconsts] = lval_copy(v);
+	return c->nconsts++;
+
+}
+
+//Keep track of how deep the stack can get
+static void lvm_push(lcode* c, int n) {
+
+	c->sp += n;
+	if(c->sp > c->depth) c->depth = c->sp;
+
+}
+
+//Frames are filled in the order the formals are declared, so the index is the slot
+static int lvm_formal(lcode* c, char* sym) {
+
+	for(int i = 0; i < c->nformals; i++)
+		if(c->locals[i] == sym) return i;
+	return -1;
+
+}
+
+static void lvm_compile_sexpr(lcode*, lval**, int, bool);
+
+static void lvm_compile_expr(lcode* c, lval* x, bool tail) {
+
+	switch(LTYPE(x)) {
+		case(LVAL_SYM):
+			if(lvm_formal(c, x->str) >= 0) {
+				lvm_emit(c, LOP_LOCAL);
+				lvm_emit(c, lvm_const(c, x));
+				lvm_emit(c, lvm_formal(c, x->str));
+			} else {
+				lvm_emit(c, LOP_GLOBAL);
+				lvm_emit(c, lvm_const(c, x));
+			}
+			lvm_push(c, 1);
+			break;
+		case(LVAL_SEXPR):
+			lvm_compile_sexpr(c, x->cell, x->count, tail);
+			return;
+		default:
+			lvm_emit(c, LOP_CONST);
+			lvm_emit(c, lvm_const(c, x));
+			lvm_push(c, 1);
+			break;
+	}
+
+	if(tail) lvm_emit(c, LOP_RETURN);
+
+}
+
+/* (if c {a} {b})
+ * If the first element still evaluates to builtin_if at runtime we jump between
+ * the compiled branches, otherwise we fall back to calling whatever it is
+ */
+static void lvm_compile_if(lcode* c, lval** cells, bool tail) {
+
+	int base = c->sp;
+	int a = lvm_const(c, cells[2]);
+	int b = lvm_const(c, cells[3]);
+
+	lvm_compile_expr(c, cells[0], false);
+	lvm_emit(c, LOP_IF);
+	int generic = lvm_emit(c, 0);
+	c->sp--;
+
+	lvm_compile_expr(c, cells[1], false);
+	lvm_emit(c, LOP_JUMP_IF);
+	int other = lvm_emit(c, 0);
+	lvm_emit(c, a);
+	lvm_emit(c, b);
+	c->sp--;
+
+	lvm_compile_sexpr(c, cells[2]->cell, cells[2]->count, tail);
+	lvm_emit(c, LOP_JUMP);
+	int end_a = lvm_emit(c, 0);
+
+	c->sp = base;
+	c->ops[other] = c->count;
+	lvm_compile_sexpr(c, cells[3]->cell, cells[3]->count, tail);
+	lvm_emit(c, LOP_JUMP);
+	int end_b = lvm_emit(c, 0);
+
+	c->sp = base + 1;  //The if is still on the stack
+	c->ops[generic] = c->count;
+	lvm_compile_expr(c, cells[1], false);
+	lvm_emit(c, LOP_CONST);
+	lvm_emit(c, a);
+	lvm_emit(c, LOP_CONST);
+	lvm_emit(c, b);
+	lvm_push(c, 2);
+	lvm_emit(c, tail ? LOP_TAILCALL : LOP_CALL);
+	lvm_emit(c, 3);
+	c->sp -= 3;
+
+	c->ops[end_a] = c->count;
+	c->ops[end_b] = c->count;
+	c->sp = base + 1;
+
+}
+
+//Compile the evaluation of an sexpr made up of cells
+static void lvm_compile_sexpr(lcode* c, lval** cells, int count, bool tail) {
+
+	if(count == 0) {
+		lvm_emit(c, LOP_SEXPR);
+		lvm_push(c, 1);
+		if(tail) lvm_emit(c, LOP_RETURN);
+		return;
+	}
+
+	if(count == 4 && LTYPE(cells[0]) == LVAL_SYM && cells[0]->str == lsym_intern("if") &&
+	   LTYPE(cells[2]) == LVAL_QEXPR && LTYPE(cells[3]) == LVAL_QEXPR) {
+		lvm_compile_if(c, cells, tail);
+		return;
+	}
+
+	for(int i = 0; i < count; i++)
+		lvm_compile_expr(c, cells[i], false);
+
+	if(count == 1) {
+		lvm_emit(c, tail ? LOP_TAILEVAL : LOP_EVAL);
+		return;
+	}
+
+	lvm_emit(c, tail ? LOP_TAILCALL : LOP_CALL);
+	lvm_emit(c, count - 1);
+	c->sp -= count - 1;
+
+}
+
+void lvm_compile(lcode* c) {
+
+	lvm_compile_sexpr(c, c->body->cell, c->body->count, true);
+	c->compiled = true;
+
+}
+
+//The value stack is shared by every running lcode
+static lval** lvm_stack = NULL;
+static int lvm_sp = 0;
+static int lvm_max = 0;
+
+#ifdef LISP_GC_MARK_SWEEP
+//Everything on the value stack is still in use
+void lvm_mark() {
+
+	for(int i = 0; i < lvm_sp; i++)
+		lpool_mark(lvm_stack[i]);
+
+}
+#endif
+
+//Pop every value above base
+static void lvm_unwind(int base) {
+
+	while(lvm_sp > base) lval_del(lvm_stack[--lvm_sp]);
+
+}
+
+//Move the top n values into a new sexpr
+static lval* lvm_collect(int n) {
+
+	lval* x = lval_sexp();
+	lval_reserve(x, n);
+	x->count = n;
+	lvm_sp -= n;
+	memcpy(x->cell, &lvm_stack[lvm_sp], sizeof(lval*) * n);
+	return x;
+
+}
+
+/* Run the compiled body c in e
+ * *kind says whether the result is a value, an expression to be evaluated, or
+ * an sexpr of already evaluated values to be applied
+ */
+lval* lvm_run(lcode* c, lenv* e, lvm_result* kind) {
+
+	if(lvm_sp + c->depth > lvm_max) {
+		lvm_max = (lvm_sp + c->depth) * 2;
+		lvm_stack = realloc(lvm_stack, sizeof(lval*) * lvm_max);
+	}
+
+	int base = lvm_sp;
+	int pc = 0;
+	*kind = LVM_VALUE;
+
+	//Push x, bailing out on errors the same way sexpr evaluation does
+	#define PUSH(x) do { lval* _x = (x); if(LTYPE(_x) == LVAL_ERR) { lvm_unwind(base); return _x; } lvm_stack[lvm_sp++] = _x; } while(false)
+
+	while(true) {
+		switch((lop) c->ops[pc++]) {
+			case(LOP_CONST):
+				PUSH(lval_copy(c->consts[c->ops[pc++]]));
+				break;
+			case(LOP_LOCAL): {
+				lval* k = c->consts[c->ops[pc++]];
+				int slot = c->ops[pc++];
+				if(e->flat && slot < e->count && e->table[slot].sym == k->str) {
+					PUSH(lval_copy(e->table[slot].v));
+				} else PUSH(lenv_get(e, k));  //Repeated formals can throw the order off
+				break;
+			}
+			case(LOP_GLOBAL):
+				PUSH(lenv_get(e, c->consts[c->ops[pc++]]));
+				break;
+			case(LOP_SEXPR):
+				PUSH(lval_sexp());
+				break;
+			case(LOP_CALL): {
+				lval* call = lvm_collect(c->ops[pc++] + 1);
+				PUSH(lval_apply(e, call));
+				break;
+			}
+			case(LOP_TAILCALL):
+				*kind = LVM_APPLY;
+				return lvm_collect(c->ops[pc] + 1);
+			case(LOP_EVAL):
+				lvm_sp--;
+				PUSH(lval_eval(e, lvm_stack[lvm_sp]));
+				break;
+			case(LOP_TAILEVAL):
+				*kind = LVM_EVAL;
+				return lvm_stack[--lvm_sp];
+			case(LOP_IF):
+				if(LTYPE(lvm_stack[lvm_sp - 1]) == LVAL_FUNC && lvm_stack[lvm_sp - 1]->builtin == builtin_if) {
+					lval_del(lvm_stack[--lvm_sp]);
+					pc++;
+				} else pc = c->ops[pc];
+				break;
+			case(LOP_JUMP_IF): {
+				lval* cond = lvm_stack[--lvm_sp];
+				if(cond == LVAL_TRUE) {
+					pc += 3;
+				} else if(cond == LVAL_FALSE) {
+					pc = c->ops[pc];
+				} else {  //Let if complain about it
+					lval* args = lval_append(lval_sexp(), cond);
+					args = lval_append(args, lval_copy(c->consts[c->ops[pc + 1]]));
+					args = lval_append(args, lval_copy(c->consts[c->ops[pc + 2]]));
+					PUSH(builtin_if(e, args));
+				}
+				break;
+			}
+			case(LOP_JUMP):
+				pc = c->ops[pc];
+				break;
+			case(LOP_RETURN):
+				return lvm_stack[--lvm_sp];
+		}
+	}
+
+	#undef PUSH
+
+}
@@ -25,9 +25,11 @@
 
 #include <pthread.h>
 
-#include "mpc.h"
-
+#ifdef LISP_BOOT
 #include "std_lisp.h"
+#else
+#include "std_image.h"
+#endif
 #include "lisp.h"
 #include "version.h"
 
@@ -37,7 +39,8 @@ static char buffer[2048];
 
 char* readline(char* prompt) {
 
-	fputs(prompt, stdout);
+	lbuf_puts(&lbuf_out, prompt);
+	lbuf_flush(&lbuf_out);
 	fgets(buffer, 2048, stdin);
 	char* cpy = malloc(strlen(buffer)+1);
 	strcpy(cpy, buffer);
@@ -66,51 +69,44 @@ void add_history(char* unused) {UNUSED(unused);}
 
 #endif // WINDOWS
 
-mpc_parser_t* Number;
-mpc_parser_t* Boolean;
-mpc_parser_t* String;
-mpc_parser_t* Comment;
-mpc_parser_t* Symbol;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Lisp;
-
-
-lenv* init() {
-	
-	//Init the parser
-	Number	= mpc_new("number");
-	Boolean	= mpc_new("boolean");
-	String	= mpc_new("string");
-	Comment	= mpc_new("comment");
-	Symbol	= mpc_new("symbol");
-	Sexpr	= mpc_new("sexpr");
-	Qexpr	= mpc_new("qexpr");
-	Expr	= mpc_new("expr");
-	Lisp	= mpc_new("lisp");
-
-	mpca_lang(MPCA_LANG_DEFAULT, "                       \
-	number  : /-?[0-9]+/ ;                               \
-	boolean : \"true\" | \"false\" ;                     \
-	string  : /\"(\\\\.|[^\"])*\"/ ;                     \
-	comment : /;[^\\r\\n]*/ ;                            \
-	symbol  : /[a-zA-Z0-9_+\\-%*\\/\\\\=<>!&]+/ ;        \
-	qexpr   : '{' <expr>* '}' ;                          \
-	sexpr   : '(' <expr>* ')' ;                          \
-	expr    : <number> | <boolean> | <string> |          \
-	          <comment> | <symbol> | <sexpr> | <qexpr> ; \
-	lisp    : /^/ <expr>* /$/ ;",
-	Number, Boolean, String, Comment, Symbol, Qexpr, Sexpr, Expr, Lisp);
+/* Make the global environment
+ * It starts from image, a file made by save-image, if there is one, and from
+ * the standard library otherwise. Returns NULL if image can't be loaded.
+ */
+lenv* init(char* image) {
 
 	//Init the env
+	lsym_init();
 	lenv* e = lenv_new(LENV_INIT);
+#ifdef LISP_GC_MARK_SWEEP
+	lpool_root = e;
+#endif
 	lenv_add_builtins(e);
 	
-	//Load the standard library
-	lval* result = nparse((char*) std_lisp, (size_t) std_lisp_len, e);
-	if(result->type == LVAL_ERR) {
-		lval_println(result);
+	lval* result;
+	if(image) {
+		FILE* f = fopen(image, "rb");
+		if(f == NULL) {
+			result = lval_err("Could not load image: %s: %s", image, strerror(errno));
+		} else {
+			lser* s = lser_reader(f);
+			result = lser_load_env(e, s);
+			lser_del(s);
+			fclose(f);
+		}
+	} else {
+		//Load the standard library
+#ifdef LISP_BOOT
+		result = load(e, lstream_mem("std.lisp", (char*) std_lisp, (size_t) std_lisp_len));
+#else
+		lser* s = lser_mem(std_img, (size_t) std_img_len);  //Made from std.lisp when we were built
+		result = lser_load_env(e, s);
+		lser_del(s);
+#endif
+	}
+	if(LTYPE(result) == LVAL_ERR) {
+		lval_println(&lbuf_out, result);
+		if(image) e = NULL;  //Running without what the image had in it would just be confusing
 	}
 	lval_del(result);
 		
@@ -127,6 +123,10 @@ struct thread_args {
 
 void *thread_start(void* args) {
 	struct thread_args* a = args;
+#ifdef LISP_GC_MARK_SWEEP
+	void* base = lpool_stack_base;
+	lpool_stack_base = LPOOL_STACK_BASE();  //The collector has to scan this thread's stack now
+#endif
 	
 	lval* result;
 	if(a->length > 0) {
@@ -135,6 +135,9 @@ void *thread_start(void* args) {
 		result = parse(a->input, a->e);
 	}
 	
+#ifdef LISP_GC_MARK_SWEEP
+	lpool_stack_base = base;
+#endif
 	return result;
 }
 
@@ -167,14 +170,50 @@ lval *subthread_parse(char* input, size_t length, lenv* e) {
 
 int main(int argc, char** argv){
 
-	lenv* e = init();
+#ifdef LISP_GC_MARK_SWEEP
+	lpool_stack_base = LPOOL_STACK_BASE();
+#endif
+	atexit(lbuf_flush_out);  //Anything still in lbuf_out when we return or exit()
+
+	//Options have to be handled before we start evaluating anything
+	char* image = NULL;
+	bool simd = true;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--no-compile") == 0) lvm_enabled = false;
+		else if(strcmp(argv[i], "--no-simd") == 0) simd = false;
+		else if(strcmp(argv[i], "--image") == 0 && i + 1 < argc) image = argv[++i];
+	}
+
+	lvec_init(simd);
+	lenv* e = init(image);
+	if(e == NULL) return 1;
+
+#ifdef LISP_BOOT
+	//The build uses this to make std_image.h, see src/CMakeLists.txt
+	if(argc == 3 && strcmp(argv[1], "--write-image") == 0) {
+		FILE* f = fopen(argv[2], "wb");
+		char* why = f ? lser_save_env(e, f) : strerror(errno);
+		if(f && fclose(f) && !why) why = strerror(errno);
+		if(why) {
+			fprintf(stderr, "%s: %s\n", argv[2], why);
+			return 1;
+		}
+		return 0;
+	}
+#endif
 	
 	//Read in files
 	if(argc >= 2) {
 		for(int i = 1; i < argc; i++){
+			if(strcmp(argv[i], "--image") == 0) {
+				i++;  //Skip the image's name too
+				continue;
+			}
+			if(strncmp(argv[i], "--", 2) == 0) continue;  //Skip options
+
 			lval* args = lval_append(lval_sexp(), lval_str(argv[i]));
 			lval* err = builtin_load(e, args);
-			if(err->type == LVAL_ERR) lval_println(err);
+			if(LTYPE(err) == LVAL_ERR) lval_println(&lbuf_out, err);
 			lval_del(err);
 		}
 	}
@@ -183,20 +222,21 @@ int main(int argc, char** argv){
 		lval* args = lval_append(lval_sexp(), lval_str("stdin"));
 		lval* err = builtin_load(e, args);
 		
-		if(err->type == LVAL_ERR) {
-			lval_println(err);
+		if(LTYPE(err) == LVAL_ERR) {
+			lval_println(&lbuf_out, err);
 			return 1;
 		}
 		return 0;
 	}
 
 	//Version and exit info
-	puts("lisp-forty " PROJECT_VERSION "\n\n\
+	lbuf_puts(&lbuf_out, "lisp-forty " PROJECT_VERSION "\n\n\
 Copyright (C) 2014-16 Sean Anderson\n\
 License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>\n\
 There is NO warranty, not even for MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.\n\n\
-Ctrl-C or (exit 0) to exit");
+Ctrl-C or (exit 0) to exit\n");
 	//printf("%i", sizeof(lval));
+	lbuf_flush(&lbuf_out);  //readline() doesn't know about it
 
 	// Main loop
 	for(char* input = readline("lisp> "); input != NULL; input = readline("lisp> ")) {
@@ -207,18 +247,20 @@ Ctrl-C or (exit 0) to exit");
 		add_history(input);
 
 		lval* tree = subthread_parse(input, 0, e);
-		lval_println(tree);
+		lval_println(&lbuf_out, tree);
 		lval_del(tree);
+		lbuf_flush(&lbuf_out);
 
 		free(input);
 	}
 
 	// Handle ^D correctly
-	puts("");
+	lbuf_putc(&lbuf_out, '\n');
 
 	lenv_del(e);
+	lpool_cleanup();
+	lsym_cleanup();
 
-	mpc_cleanup(9, Number, Boolean, String, Comment, Symbol, Sexpr, Qexpr, Expr, Lisp);
 	return 0;
 
 }
@@ -227,17 +269,12 @@ lval* nparse(char* input, size_t length, lenv* e) {
 	
 	if(input == NULL) return lval_sexp();  //Check for a null input
 
-	mpc_result_t r;
-	if(!(mpc_nparse("<stdin>", input, length, Lisp, &r))){
-		//Failure to parse the input
-		lval* err = lval_err(mpc_err_string(r.error));
-		mpc_err_delete(r.error);
-		return err;
-	}
-	
-	//mpc_ast_print(r.output);
-	lval* tree = lval_eval(e, lval_read(r.output));
-	mpc_ast_delete(r.output);
+	//Read in the nursery too, so eval never fills an old list with young values
+	lpool_nursery_enter();
+	lval* expr = lread("<stdin>", input, length);
+	lval* tree = LTYPE(expr) == LVAL_ERR ? expr : lval_eval(e, expr);  //Failure to parse the input
+	tree = lval_promote(tree);  //The caller still needs tree
+	lpool_nursery_leave();
 	return tree;
 }
 
@@ -245,179 +282,217 @@ lval* parse(char* input, lenv* e) {
 	
 	if(input == NULL) return lval_sexp();  //Check for a null input
 
-	mpc_result_t r;
-	if(!(mpc_parse("<stdin>", input, Lisp, &r))){
-		//Failure to parse the input
-		lval* err = lval_err(mpc_err_string(r.error));
-		mpc_err_delete(r.error);
-		return err;
-	}
-	
-	//mpc_ast_print(r.output);
-	lval* tree = lval_eval(e, lval_read(r.output));
-	mpc_ast_delete(r.output);
-	return tree;
+	return nparse(input, strlen(input), e);
 }
 
-//Read a number from an abstract syntax tree
-lval* lval_read_num(mpc_ast_t* t){
+/* Read and evaluate the forms in s one at a time, then delete s
+ * Only a syntax error stops things early, and it is returned instead of ()
+ */
+lval* load(lenv* e, lstream* s) {
+
+	lval* err = NULL;
+	for(bool done = false; !done;) {
+		lpool_nursery_enter();  //Before reading, so the form is as young as what eval puts in it
+		lval* expr = lread_next(s);
+		if(expr) {
+			lval* v = lval_eval(e, expr);
+			if(LTYPE(v) == LVAL_ERR) lval_println(&lbuf_out, v);
+			lval_del(v);
+		} else {
+			err = lstream_err(s);
+			if(err) err = lval_promote(err);
+			done = true;
+		}
+		lpool_nursery_leave();
+	}
 
-	errno = 0;
-	long num = strtol(t->contents, NULL, 10);  //Base 10
-	return errno != ERANGE ? lval_num(num) : lval_err("invalid number");
+	lstream_del(s);
+	return err ? err : lval_sexp();
 
 }
 
-lval* lval_read_str(mpc_ast_t* t){
+/* Evaluate v in e
+ * This is a trampoline: whenever the last thing a form does is evaluate another
+ * expression (the body of a lambda, a branch of if, the argument to eval) we
+ * loop around instead of recursing. A lambda called in tail position replaces
+ * the lambda we were in: it takes over that lambda's bindings and parent scope,
+ * so it sees exactly what it would have seen as a nested call.
+ * If evaluated is set, v is an sexpr whose children have already been evaluated.
+ */
+static lval* lval_eval_loop(lenv* e, lval* v, bool evaluated) {
 
-	//Replace the last " with \0
-	t->contents[strlen(t->contents)-1] = '\0';
-	//Copy w/o the first '
-	char* unescaped = malloc(strlen(t->contents + 1) + 1);
-	strcpy(unescaped, t->contents + 1);
+	lval* lambda = NULL;  //The lambda whose body we are evaluating, if any
+	lenv* frame = NULL;  //And the frame its formals are bound in
 
-	unescaped = mpcf_unescape(unescaped);
-	lval* str = lval_str(unescaped);
-	free(unescaped);
-	return str;
+	while(true) {
 
-}
+		if(LTYPE(v) == LVAL_SYM) {
+			lval* x = lenv_get(e, v);
+			lval_del(v);
+			v = x;
+			break;
+		}
 
-lval* lval_read(mpc_ast_t* t){
+		//Everything but sexprs evaluates to itself
+		if(LTYPE(v) != LVAL_SEXPR) break;
+		v = lval_own(v);
 
-	//mpc_ast_print(t);
+		//Evaluate children
+		int i;
+		for(i = 0; i < v->count && !evaluated; i++){
+			v->cell[i] = lval_eval(e, v->cell[i]);
+			if(LTYPE(v->cell[i]) == LVAL_ERR) break;
+		}
+		if(i < v->count && !evaluated) {
+			v = lval_take(v, i);
+			break;
+		}
+		evaluated = false;
 
-	//Return if it's not an sexpr or qexpr
-	if(strstr(t->tag, "number")) return lval_read_num(t);
-	if(strstr(t->tag, "symbol")) return lval_sym(t->contents);
-	if(strstr(t->tag, "|string|")) return lval_read_str(t);
-	if(strstr(t->tag, "boolean")) {
-		if(strstr(t->contents, "true")) return LVAL_TRUE;
-		else return LVAL_FALSE;
-	}
+		//Deal with empty/1 value sexprs
+		if(v->count == 0) break;
+		if(v->count == 1) {
+			v = lval_take(v, 0);
+			continue;
+		}
 
-	//It should be an ?expr or the root
-	lval* tree = NULL;
-	//Check to be sure
-	if((strcmp(t->tag, ">") == 0) || strstr(t->tag, "sexpr")) tree = lval_sexp();
-	if(strstr(t->tag, "qexpr")) tree = lval_qexpr();
+		//Make sure we have a function
+		lval* func = lval_pop(v, 0);
+		if(LTYPE(func) != LVAL_FUNC){
+			lval* err = lval_err("S-Expression does not start with a function: got %s, expected %s", ltype_name(LTYPE(func)), ltype_name(LVAL_FUNC));
+			lval_del(func);
+			lval_del(v);
+			v = err;
+			break;
+		}
 
-	for(int i = 0; i < t->children_num; i++){
-		#define IF_NOT(string) if(strcmp(t->children[i]->contents, string) == 0) continue;
-		IF_NOT("(")
-		IF_NOT(")")
-		IF_NOT("{")
-		IF_NOT("}")
-		#undef IF_NOT
-		if(strcmp(t->children[i]->tag, "regex") == 0) continue;
-		if(strstr(t->children[i]->tag, "comment")) continue;
-		tree = lval_append(tree, lval_read(t->children[i]));
-	}
+		if(func->builtin) {
+			lbuiltin builtin = func->builtin;
+			lval_del(func);
+			v = builtin(e, v);  //Builtins delete their args
+			if(builtin == builtin_if || builtin == builtin_eval) continue;  //These hand back an expression to evaluate
+			break;
+		}
 
-	return tree;
+		lenv* next = NULL;
+		lval* x = lval_call(func, v, &next);
+		if(!next) {  //An error, or a partially applied func
+			lval_del(func);
+			v = x;
+			break;
+		}
 
-}
+		//Evaluate the body in place of the current lambda
+		if(frame) {
+			lenv_absorb(next, frame);  //Anything the old lambda could see, the new one still can
+			next->par = frame->par;
+			lenv_del(frame);
+			lval_del(lambda);
+		} else next->par = e;
+		lambda = func;
+		frame = next;
+		e = frame;
+
+		lcode* code = lambda->code;
+		if(lvm_enabled) {
+			if(!code->compiled) lvm_compile(code);
+
+			lvm_result kind;
+			v = lvm_run(code, e, &kind);
+			if(kind == LVM_VALUE) break;
+			evaluated = (kind == LVM_APPLY);
+			continue;
+		}
 
-//Evaluate an sexpr
-lval* lval_eval_sexpr(lenv* e, lval* v){
+		v = lval_own(lval_copy(code->body));
+		v->type = LVAL_SEXPR;
 
-	//Evaluate children
-	for(int i = 0; i < v->count; i++){
-		v->cell[i] = lval_eval(e, v->cell[i]);
-		if(v->cell[i]->type == LVAL_ERR) return lval_take(v, i);
 	}
 
-	//Deal with empty/1 value sexprs
-	if(v->count == 0) return v;
-	if(v->count == 1) return lval_eval(e, lval_take(v, 0));
-
-	//Make sure we have a function
-	lval* func = lval_pop(v, 0);
-	if(func->type != LVAL_FUNC){
-		lval* err = lval_err("S-Expression does not start with a function: got %s, expected %s", ltype_name(func->type), ltype_name(LVAL_FUNC));
-		lval_del(func);
-		lval_del(v);
-		return err;
+	if(frame) {
+		lenv_del(frame);
+		lval_del(lambda);
 	}
-
-	lval* result = lval_call(e, func, v);
-	lval_del(func);  //builtin_op deletes v
-	return result;
+	return v;
 
 }
 
 lval* lval_eval(lenv* e, lval* v) {
+	return lval_eval_loop(e, v, false);
+}
 
-	if(v->type == LVAL_SYM){
-		lval* x = lenv_get(e, v);
-		lval_del(v);
-		return x;
-	}
-
-	//eval sexprs
-	if(v->type == LVAL_SEXPR) return lval_eval_sexpr(e, v);
-	//And everything else
-	return v;
+//Call the function at the head of an sexpr of evaluated values
+lval* lval_apply(lenv* e, lval* v) {
+	return lval_eval_loop(e, v, true);
 }
 
-lval* lval_call(lenv* e, lval* func, lval* args) {
+/* Apply the lambda func to args, consuming args but not func
+ * If that binds every formal, *frame is set to a new frame holding the
+ * arguments and NULL is returned. Otherwise we return either an error or func
+ * partially applied to args.
+ */
+lval* lval_call(lval* func, lval* args, lenv** frame) {
 
-	if(func->builtin) return func->builtin(e, args);
+	lval* formals = func->code->formals;
 
 	int given = args->count;
-	int total = func->formals->count;
-
-	while(args->count) {
-		if(func->formals->count == 0) {
+	int total = formals->count - func->nbound;
+
+	//Work out how many formals args covers
+	int i = func->nbound;
+	int taken = 0;
+	bool rest = false;
+	for(; taken < args->count || i < formals->count; i++, taken++) {
+		if(i == formals->count) {
 			lval_del(args);
 			return lval_err("Function passed too many arguments: got %i, expected %i", given, total);
 		}
 
-		//Define the func's arguments to be what was passed
-		lval* sym = lval_pop(func->formals, 0);
-
-		//Special variable-arguments case
-		if(strcmp(sym->str, "&") == 0) {
-			if(func->formals->count != 1) {  //& must be followed by exactly one symbol
+		//Special variable-arguments case, which also covers no arguments left for it
+		if(formals->cell[i]->str == LSYM_AMP) {
+			if(formals->count - i != 2) {  //& must be followed by exactly one symbol
 				lval_del(args);
 				return lval_err("Function format invalid: symbol \"&\" not followed by exactly one symbol");
 			}
-
-			lval* nsym = lval_pop(func->formals, 0);
-			lenv_put(func->env, nsym, builtin_list(e, args));  //Bind the last formal to a list of the remaining args
-			lval_del(sym);
-			lval_del(nsym);
+			rest = true;
 			break;
 		}
 
-		lval* val = lval_pop(args, 0);
-		lenv_put(func->env, sym, val);
-		lval_del(val);
-		lval_del(sym);
+		if(taken == args->count) break;
 	}
 
-	lval_del(args);
-
-	//If we have unpassed variable arguments
-	if(func->formals->count > 0 && strcmp(func->formals->cell[0]->str, "&") == 0) {
-		if(func->formals->count != 2) //& has to have a list to bind
-			return lval_err("Function format invalid: symbol \"&\" not followed by exactly one symbol");
-
-		lval_del(lval_pop(func->formals, 0));  //Pop the &
-
-		lval* sym = lval_pop(func->formals, 0);
-		lval* val = lval_qexpr();
-		lenv_put(func->env, sym, val);
-		lval_del(sym);
-		lval_del(val);
+	if(!rest && i < formals->count) {  //Just return the .5 eval'd func
+		lval* x = lval_partial(func, args, taken);
+		args->count = 0;  //x has the args now
+		lval_del(args);
+		return x;
+	}
 
+	int size = LENV_LOCAL_INIT;
+	while(size < formals->count) size *= 2;
+	lenv* f = lenv_frame(size);
+
+	//Fill the frame in the order the formals were declared
+	lval* bound[func->nbound + 1];
+	largs_flatten(func, bound);
+	for(int j = 0; j < func->nbound; j++)
+		lenv_bind(f, formals->cell[j], lval_copy(bound[j]));
+	for(int j = 0; j < taken; j++)
+		lenv_bind(f, formals->cell[func->nbound + j], args->cell[j]);
+
+	if(rest) {  //Bind the last formal to a list of the remaining args
+		lval* list = lval_qexpr();
+		lval_reserve(list, args->count - taken);
+		list->count = args->count - taken;
+		memcpy(list->cell, &args->cell[taken], sizeof(lval*) * list->count);
+		lenv_bind(f, formals->cell[i + 1], list);
 	}
 
-	if(func->formals->count == 0) {  //Evaluate and return
-		func->env->par = e;
-		return builtin_eval(func->env, lval_append(lval_sexp(), lval_copy(func->body)));
-	} else  //Or just return the .5 eval'd func
-		return lval_copy(func);
+	args->count = 0;  //Everything in args is bound now
+	lval_del(args);
+	*frame = f;
+	return NULL;
+
 }
 
 char* ltype_name(enum ltype type){
@@ -439,6 +514,14 @@ char* ltype_name(enum ltype type){
 			return "S-Expression";
 		case(LVAL_QEXPR):
 			return "Q-Expression";
+		case(LVAL_BIGNUM):
+			return "Bignum";
+		case(LVAL_DOUBLE):
+			return "Double";
+		case(LVAL_VEC):
+			return "Vector";
+		case(LVAL_MAP):
+			return "Map";
 		default:
 			return "Not an LVAL!";
 	}
@@ -452,54 +535,112 @@ char* ltype_name(enum ltype type){
 //Check if we got the right number of args
 #define LASSERT_ARGS(args, func, num_args, expected) do { LASSERT((args), ((num_args) != (expected)), "Function \"%s\" passed wrong number of args: got %i, expected %i", (func), (num_args), (expected)); } while(false)
 //Check if the list is empty
-#define LASSERT_EMPTY(args, func, list) do { LASSERT((args), ((list)->count == 0), "Function \"%s\" passed empty %s", (func), ltype_name((list)->type)); } while(false)
+#define LASSERT_EMPTY(args, func, list) do { LASSERT((args), ((list)->count == 0), "Function \"%s\" passed empty %s", (func), ltype_name(LTYPE(list))); } while(false)
+
+static char* arith_name(arith op) {
+	switch(op) {
+		case(ARITH_ADD): return "+";
+		case(ARITH_SUB): return "-";
+		case(ARITH_MUL): return "*";
+		case(ARITH_DIV): return "/";
+		case(ARITH_MOD): return "%";
+		case(ARITH_POW): return "pow";
+		case(ARITH_MIN): return "min";
+		case(ARITH_MAX): return "max";
+		default: return "Not an arithmetic function!";
+	}
+}
 
-lval* builtin_op(lenv* e, lval* args, char* op){
+typedef enum arith_result {ARITH_OK, ARITH_DIV_ZERO, ARITH_OVERFLOW} arith_result;
 
-	UNUSED(e);
+//Apply op to x and y, leaving x alone unless the result fits in a long
+static inline arith_result arith_step(arith op, long* x, long y) {
 
-	for(int i = 0; i < args->count; i++)
-		LASSERT_TYPE(args, op, i, args->cell[i]->type, LVAL_NUM);
+	long r;
+	switch(op) {
+		case(ARITH_ADD): if(__builtin_add_overflow(*x, y, &r)) return ARITH_OVERFLOW; break;
+		case(ARITH_SUB): if(__builtin_sub_overflow(*x, y, &r)) return ARITH_OVERFLOW; break;
+		case(ARITH_MUL): if(__builtin_mul_overflow(*x, y, &r)) return ARITH_OVERFLOW; break;
+		case(ARITH_DIV):
+			if(y == 0) return ARITH_DIV_ZERO;
+			if(y == -1 && *x == LONG_MIN) return ARITH_OVERFLOW;
+			r = *x / y;
+			break;
+		case(ARITH_MOD):
+			if(y == 0) return ARITH_DIV_ZERO;
+			r = y == -1 ? 0 : *x % y;
+			break;
+		case(ARITH_POW):
+			if(y < 0) return ARITH_OVERFLOW;  //Leave the odd cases to lnum_arith()
+			r = 1;
+			for(long base = *x; y; y >>= 1) {
+				if((y & 1) && __builtin_mul_overflow(r, base, &r)) return ARITH_OVERFLOW;
+				if(y > 1 && __builtin_mul_overflow(base, base, &base)) return ARITH_OVERFLOW;
+			}
+			break;
+		case(ARITH_MIN): r = y < *x ? y : *x; break;
+		case(ARITH_MAX): r = y > *x ? y : *x; break;
+		default: return ARITH_OVERFLOW;
+	}
+	*x = r;
+	return ARITH_OK;
 
-	lval* first = lval_pop(args, 0);
+}
 
-	if((strcmp(op, "-") == 0) && args->count == 0) first->num = -first->num;
+/* Arithmetic is done on longs for as long as everything fits in one, and only
+ * falls back to lnum_arith() once something overflows or isn't a long
+ */
+static lval* builtin_op(lenv* e, lval* args, arith op){
 
-	while(args->count > 0){
-		lval* second = lval_pop(args, 0);
+	UNUSED(e);
 
-		//Helper macro for C operators
-		#define ADD_OP(operator) do{ if(strcmp(op, #operator) == 0) first->num = first->num operator second->num; } while(false)
-		ADD_OP(+);
-		ADD_OP(-);
-		ADD_OP(*);
-		ADD_OP(%);
-		#undef ADD_OP
+	LASSERT(args, (args->count == 0), "Function \"%s\" passed no arguments", arith_name(op));
+	if(!LNUMERIC(LTYPE(args->cell[0]))) LASSERT_TYPE(args, arith_name(op), 0, LTYPE(args->cell[0]), LVAL_NUM);
 
-		//Helper macro for functions in the format "long func(long, long)"
-		#define ADD_OP(operator, function) do{ if(strcmp(op, #operator) == 0) first->num = function(first->num, second->num); } while(false)
-		ADD_OP(^, pow);
-		ADD_OP(min, fmin);
-		ADD_OP(max, fmax);
-		#undef ADD_OP
+	//0 - 0.0 is 0.0, not -0.0, so doubles can't be negated like everything else
+	if(op == ARITH_SUB && args->count == 1 && LTYPE(args->cell[0]) == LVAL_DOUBLE) {
+		lval* r = lval_double(-args->cell[0]->dbl);
+		lval_del(args);
+		return r;
+	}
 
-		//And divide gets its own thing
-		if(strcmp(op, "/") == 0) {
-			if(second->num == 0) {
-				lval_del(first);
-				lval_del(second);
-				first = lval_err("Division by zero");
-				break;  //Exit the while loop
+	long x = 0;
+	lval* big = NULL;  //The result so far, if it isn't in x
+	int i = 1;
+	if(op == ARITH_SUB && args->count == 1) i = 0;  //Negation is 0 - x
+	else if(LTYPE(args->cell[0]) == LVAL_NUM) x = LNUM(args->cell[0]);
+	else big = lval_copy(args->cell[0]);
+
+	//Almost every call has two arguments, which is just one trip around this
+	for(; i < args->count; i++) {
+		lval* y = args->cell[i];
+		if(!big && LTYPE(y) == LVAL_NUM) {
+			arith_result r = arith_step(op, &x, LNUM(y));
+			if(r == ARITH_OK) continue;
+			if(r == ARITH_DIV_ZERO) {
+				lval_del(args);
+				return lval_err("Division by zero");
 			}
-			first->num /= second->num;
 		}
 
-		lval_del(second);
-
+		if(!LNUMERIC(LTYPE(y))) {
+			if(big) lval_del(big);
+			LASSERT_TYPE(args, arith_name(op), i, LTYPE(y), LVAL_NUM);
+		}
+		if(!big) big = lval_num(x);
+		lval* r = lnum_arith(op, big, y);
+		lval_del(big);
+		big = r;
+		if(LTYPE(big) == LVAL_ERR) break;
+		if(LTYPE(big) == LVAL_NUM) {  //Back down to something that fits
+			x = LNUM(big);
+			lval_del(big);
+			big = NULL;
+		}
 	}
 
 	lval_del(args);
-	return first;
+	return big ? big : lval_num(x);
 
 }
 
@@ -509,13 +650,11 @@ lval* builtin_head(lenv* e, lval* args) {
 	UNUSED(e);
 	
 	LASSERT_ARGS(args, "head", args->count, 1);
-	LASSERT_TYPE(args, "head", 0, args->cell[0]->type, LVAL_QEXPR);
+	LASSERT_TYPE(args, "head", 0, LTYPE(args->cell[0]), LVAL_QEXPR);
 	LASSERT_EMPTY(args, "head", args->cell[0]);
 
-	lval* v = lval_take(args, 0);
-	while(v->count > 1)
-		lval_del(lval_pop(v, 1));  //Delete everything until we have 1 argument left
-
+	lval* v = lval_slice(args->cell[0], 0, 1);
+	lval_del(args);
 	return v;
 
 }
@@ -526,11 +665,12 @@ lval* builtin_tail(lenv* e, lval* args) {
 	UNUSED(e);
 
 	LASSERT_ARGS(args, "tail", args->count, 1);
-	LASSERT_TYPE(args, "tail", 0, args->cell[0]->type, LVAL_QEXPR);
+	LASSERT_TYPE(args, "tail", 0, LTYPE(args->cell[0]), LVAL_QEXPR);
 	LASSERT_EMPTY(args, "tail", args->cell[0]);
 
-	lval* v = lval_take(args, 0);
-	lval_del(lval_pop(v, 0));
+	lval* l = args->cell[0];
+	lval* v = lval_slice(l, 1, l->count);
+	lval_del(args);
 	return v;
 
 }
@@ -546,14 +686,17 @@ lval* builtin_list(lenv* e, lval* args) {
 }
 
 //Evaluate a qexpr
+//Like if, this returns the sexpr for lval_eval() to evaluate in tail position
 lval* builtin_eval(lenv* e, lval* args) {
 
+	UNUSED(e);
+
 	LASSERT_ARGS(args, "eval", args->count, 1);
-	LASSERT_TYPE(args, "eval", 0, args->cell[0]->type, LVAL_QEXPR);
+	LASSERT_TYPE(args, "eval", 0, LTYPE(args->cell[0]), LVAL_QEXPR);
 
-	lval* v = lval_take(args, 0);
+	lval* v = lval_own(lval_take(args, 0));
 	v->type = LVAL_SEXPR;
-	return lval_eval(e, v);
+	return v;
 
 }
 
@@ -562,27 +705,532 @@ lval* builtin_join(lenv* e, lval* args) {
 	UNUSED(e);
 	
 	for(int i = 0; i < args->count; i++) {
-			LASSERT_TYPE(args, "join", i, args->cell[i]->type, LVAL_QEXPR);
+			LASSERT_TYPE(args, "join", i, LTYPE(args->cell[i]), LVAL_QEXPR);
 	}
 
 	lval* x;
-	for(x = lval_pop(args, 0); args->count; lval_join(x, lval_pop(args, 0)));  //Join the arguments together
+	for(x = lval_own(lval_pop(args, 0)); args->count; lval_join(x, lval_pop(args, 0)));  //Join the arguments together
+
+	lval_del(args);
+	return x;
+
+}
+
+/* The list builtins below work on the cell array directly instead of walking
+ * the list with head and tail. Lists hold unevaluated expressions, so anything
+ * handed to a function or returned on its own is evaluated first, the same way
+ * fst would.
+ */
+static lval* lval_elem(lenv* e, lval* x) {
+	return lval_eval(e, lval_copy(x));
+}
+
+//Call f with one or two values, consuming them but not f
+static lval* lval_call_with(lenv* e, lval* f, lval* x, lval* y) {
+
+	lval* call = lval_append(lval_sexp(), lval_copy(f));
+	lval_append(call, x);
+	if(y) lval_append(call, y);
+	return lval_apply(e, call);
+
+}
+
+lval* builtin_len(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "len", args->count, 1);
+	lval* v = args->cell[0];
+	if(LTYPE(v) != LVAL_VEC) LASSERT_TYPE(args, "len", 1, LTYPE(v), LVAL_QEXPR);
+
+	lval* x = lval_num(LTYPE(v) == LVAL_VEC ? v->nelems : v->count);
+	lval_del(args);
+	return x;
+
+}
+
+lval* builtin_nth(lenv* e, lval* args) {
+
+	LASSERT_ARGS(args, "nth", args->count, 2);
+	LASSERT_TYPE(args, "nth", 1, LTYPE(args->cell[0]), LVAL_NUM);
+	LASSERT_TYPE(args, "nth", 2, LTYPE(args->cell[1]), LVAL_QEXPR);
+
+	long n = LNUM(args->cell[0]);
+	lval* l = args->cell[1];
+	LASSERT(args, (n < 0 || n >= l->count), "Function \"nth\" passed index %li for a list of length %i", n, l->count);
+
+	lval* x = lval_elem(e, l->cell[n]);
+	lval_del(args);
+	return x;
+
+}
+
+lval* builtin_last(lenv* e, lval* args) {
+
+	LASSERT_ARGS(args, "last", args->count, 1);
+	LASSERT_TYPE(args, "last", 1, LTYPE(args->cell[0]), LVAL_QEXPR);
+	LASSERT_EMPTY(args, "last", args->cell[0]);
+
+	lval* l = args->cell[0];
+	lval* x = lval_elem(e, l->cell[l->count - 1]);
+	lval_del(args);
+	return x;
+
+}
+
+typedef enum slice {SLICE_TAKE, SLICE_DROP} slice;
+
+static lval* builtin_slice(lval* args, slice func) {
+
+	char* name = func == SLICE_TAKE ? "take" : "drop";
+	LASSERT_ARGS(args, name, args->count, 2);
+	LASSERT_TYPE(args, name, 1, LTYPE(args->cell[0]), LVAL_NUM);
+	LASSERT_TYPE(args, name, 2, LTYPE(args->cell[1]), LVAL_QEXPR);
+
+	long n = LNUM(args->cell[0]);
+	lval* l = args->cell[1];
+	LASSERT(args, (n < 0 || n > l->count), "Function \"%s\" passed %li for a list of length %i", name, n, l->count);
+
+	lval* x;
+	if(func == SLICE_TAKE) x = lval_slice(l, 0, n);
+	else x = lval_slice(l, n, l->count);
+	lval_del(args);
+	return x;
+
+}
+
+lval* builtin_take(lenv* e, lval* args) {UNUSED(e); return builtin_slice(args, SLICE_TAKE);}
+lval* builtin_drop(lenv* e, lval* args) {UNUSED(e); return builtin_slice(args, SLICE_DROP);}
+
+lval* builtin_elem(lenv* e, lval* args) {
+
+	LASSERT_ARGS(args, "elem", args->count, 2);
+	LASSERT_TYPE(args, "elem", 2, LTYPE(args->cell[1]), LVAL_QEXPR);
+
+	lval* l = args->cell[1];
+	lval* found = LVAL_FALSE;
+	for(int i = 0; i < l->count && found == LVAL_FALSE; i++) {
+		lval* x = lval_elem(e, l->cell[i]);
+		if(LTYPE(x) == LVAL_ERR) {
+			lval_del(args);
+			return x;
+		}
+		found = lval_equals(args->cell[0], x);
+		lval_del(x);
+	}
+
+	lval_del(args);
+	return found;
+
+}
+
+lval* builtin_map(lenv* e, lval* args) {
+
+	LASSERT_ARGS(args, "map", args->count, 2);
+	LASSERT_TYPE(args, "map", 1, LTYPE(args->cell[0]), LVAL_FUNC);
+	LASSERT_TYPE(args, "map", 2, LTYPE(args->cell[1]), LVAL_QEXPR);
+
+	lval* f = args->cell[0];
+	lval* l = args->cell[1];
+	lval* result = lval_qexpr();
+	lval_reserve(result, l->count);
+	for(int i = 0; i < l->count; i++) {
+		lval* x = lval_elem(e, l->cell[i]);
+		if(LTYPE(x) != LVAL_ERR) x = lval_call_with(e, f, x, NULL);
+		if(LTYPE(x) == LVAL_ERR) {
+			lval_del(result);
+			lval_del(args);
+			return x;
+		}
+		result->cell[result->count++] = x;
+	}
+
+	lval_del(args);
+	return result;
+
+}
+
+lval* builtin_filter(lenv* e, lval* args) {
+
+	LASSERT_ARGS(args, "filter", args->count, 2);
+	LASSERT_TYPE(args, "filter", 1, LTYPE(args->cell[0]), LVAL_FUNC);
+	LASSERT_TYPE(args, "filter", 2, LTYPE(args->cell[1]), LVAL_QEXPR);
+
+	lval* f = args->cell[0];
+	lval* l = args->cell[1];
+	lval* result = lval_qexpr();
+	lval_reserve(result, l->count);
+	for(int i = 0; i < l->count; i++) {
+		lval* x = lval_elem(e, l->cell[i]);
+		if(LTYPE(x) != LVAL_ERR) x = lval_call_with(e, f, x, NULL);
+		if(LTYPE(x) != LVAL_BOOL) {
+			lval_del(result);
+			if(LTYPE(x) == LVAL_ERR) {
+				lval_del(args);
+				return x;
+			}
+			enum ltype type = LTYPE(x);
+			lval_del(x);
+			LASSERT(args, true, "Function \"filter\" passed a function which returned %s, expected %s", ltype_name(type), ltype_name(LVAL_BOOL));
+		}
+		if(x == LVAL_TRUE) result->cell[result->count++] = lval_copy(l->cell[i]);  //The element itself, not its value
+	}
+
+	lval_del(args);
+	return result;
+
+}
+
+lval* builtin_foldl(lenv* e, lval* args) {
+
+	LASSERT_ARGS(args, "foldl", args->count, 3);
+	LASSERT_TYPE(args, "foldl", 1, LTYPE(args->cell[0]), LVAL_FUNC);
+	LASSERT_TYPE(args, "foldl", 3, LTYPE(args->cell[2]), LVAL_QEXPR);
+
+	lval* f = args->cell[0];
+	lval* l = args->cell[2];
+	lval* acc = lval_copy(args->cell[1]);
+	for(int i = 0; i < l->count; i++) {
+		lval* x = lval_elem(e, l->cell[i]);
+		if(LTYPE(x) == LVAL_ERR) {
+			lval_del(acc);
+			acc = x;
+			break;
+		}
+		acc = lval_call_with(e, f, acc, x);
+		if(LTYPE(acc) == LVAL_ERR) break;
+	}
+
+	lval_del(args);
+	return acc;
+
+}
+
+//Every number from begin to end, inclusive
+lval* builtin_range(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "range", args->count, 2);
+	LASSERT_TYPE(args, "range", 1, LTYPE(args->cell[0]), LVAL_NUM);
+	LASSERT_TYPE(args, "range", 2, LTYPE(args->cell[1]), LVAL_NUM);
+
+	long begin = LNUM(args->cell[0]);
+	long end = LNUM(args->cell[1]);
+	lval_del(args);
+
+	lval* x = lval_qexpr();
+	if(begin > end) return x;
+	if((unsigned long) end - (unsigned long) begin >= INT_MAX) {
+		lval_del(x);
+		return lval_err("Function \"range\" passed too large a range: %li to %li", begin, end);
+	}
+
+	lval_reserve(x, end - begin + 1);
+	for(long i = begin; i <= end; i++)
+		x->cell[x->count++] = lval_num(i);
+	return x;
+
+}
+
+//Pack a list of integers into a vector
+lval* builtin_vec(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "vec", args->count, 1);
+	LASSERT_TYPE(args, "vec", 1, LTYPE(args->cell[0]), LVAL_QEXPR);
+
+	lval* l = args->cell[0];
+	for(int i = 0; i < l->count; i++)
+		LASSERT(args, LTYPE(l->cell[i]) != LVAL_NUM, "Function \"vec\" passed incorrect type for element %i: got %s, expected %s",
+			i, ltype_name(LTYPE(l->cell[i])), ltype_name(LVAL_NUM));
+
+	long* elems = lvec_alloc(l->count);
+	for(int i = 0; i < l->count; i++)
+		elems[i] = LNUM(l->cell[i]);
+	lval* v = lval_vec(l->count, elems);
+	lval_del(args);
+	return v;
+
+}
+
+//Unpack a vector into a list
+lval* builtin_vec_list(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "vec-list", args->count, 1);
+	LASSERT_TYPE(args, "vec-list", 1, LTYPE(args->cell[0]), LVAL_VEC);
+
+	lval* v = args->cell[0];
+	lval* x = lval_qexpr();
+	lval_reserve(x, v->nelems);
+	for(int i = 0; i < v->nelems; i++)
+		x->cell[x->count++] = lval_num(v->elems[i]);
+	lval_del(args);
+	return x;
+
+}
+
+//vsum, vprod, vmin, and vmax
+static lval* builtin_vfold(lenv* e, lval* args, arith op, char* name) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, name, args->count, 1);
+	LASSERT_TYPE(args, name, 1, LTYPE(args->cell[0]), LVAL_VEC);
+	if(op == ARITH_MIN || op == ARITH_MAX) LASSERT(args, args->cell[0]->nelems == 0, "Function \"%s\" passed empty %s", name, ltype_name(LVAL_VEC));
+
+	lval* x = lvec_fold(op, args->cell[0]);
+	lval_del(args);
+	return x;
+
+}
+
+//Check that the second argument is a vector as long as the first, or a number
+#define LASSERT_VEC_ARGS(args, name, number) do { \
+	LASSERT_ARGS((args), (name), (args)->count, 2); \
+	LASSERT_TYPE((args), (name), 1, LTYPE((args)->cell[0]), LVAL_VEC); \
+	lval* y = (args)->cell[1]; \
+	if(!(number) || LTYPE(y) != LVAL_NUM) LASSERT_TYPE((args), (name), 2, LTYPE(y), LVAL_VEC); \
+	LASSERT((args), LTYPE(y) == LVAL_VEC && y->nelems != (args)->cell[0]->nelems, \
+		"Function \"%s\" passed vectors of different lengths: %i and %i", (name), (args)->cell[0]->nelems, y->nelems); \
+} while(false)
+
+lval* builtin_vdot(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_VEC_ARGS(args, "vdot", false);
+
+	lval* x = lvec_dot(args->cell[0], args->cell[1]);
+	lval_del(args);
+	return x;
+
+}
+
+//v+ and v*
+static lval* builtin_vmap(lenv* e, lval* args, arith op, char* name) {
+
+	UNUSED(e);
+	LASSERT_VEC_ARGS(args, name, true);
+
+	lval* x = lvec_map(op, args->cell[0], args->cell[1]);
+	lval_del(args);
+	return x;
+
+}
+
+//v<, v>, and v==
+static lval* builtin_vcompare(lenv* e, lval* args, rel op, char* name) {
+
+	UNUSED(e);
+	LASSERT_VEC_ARGS(args, name, true);
+
+	lval* x = lvec_compare(op, args->cell[0], args->cell[1]);
+	lval_del(args);
+	return x;
+
+}
+
+#undef LASSERT_VEC_ARGS
+
+lval* builtin_str_len(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "str-len", args->count, 1);
+	LASSERT_TYPE(args, "str-len", 1, LTYPE(args->cell[0]), LVAL_STR);
+
+	lval* x = lval_num(args->cell[0]->len);
+	lval_del(args);
+	return x;
+
+}
+
+//Concatenate strings, which only copies short ones, see lval_str_cat()
+lval* builtin_str_cat(lenv* e, lval* args) {
+
+	UNUSED(e);
+	long len = 0;
+	for(int i = 0; i < args->count; i++) {
+		LASSERT_TYPE(args, "str-cat", i + 1, LTYPE(args->cell[i]), LVAL_STR);
+		len += args->cell[i]->len;
+	}
+	LASSERT(args, (len > INT_MAX), "Function \"str-cat\" would make a string %li bytes long", len);
+
+	lval* x = args->count ? lval_pop(args, 0) : lval_str("");
+	while(args->count) x = lval_str_cat(x, lval_pop(args, 0));
+	lval_del(args);
+	return x;
+
+}
+
+//The bytes of a string from start up to end, without copying them
+lval* builtin_substr(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "substr", args->count, 3);
+	LASSERT_TYPE(args, "substr", 1, LTYPE(args->cell[0]), LVAL_NUM);
+	LASSERT_TYPE(args, "substr", 2, LTYPE(args->cell[1]), LVAL_NUM);
+	LASSERT_TYPE(args, "substr", 3, LTYPE(args->cell[2]), LVAL_STR);
+
+	long start = LNUM(args->cell[0]);
+	long end = LNUM(args->cell[1]);
+	int len = args->cell[2]->len;
+	LASSERT(args, (start < 0 || start > end || end > len), "Function \"substr\" passed %li to %li for a string of length %i", start, end, len);
+
+	lval* x = lval_substr(lval_pop(args, 2), start, end);
+	lval_del(args);
+	return x;
+
+}
+
+//Where the first string first appears in the second, or -1
+lval* builtin_str_find(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "str-find", args->count, 2);
+	LASSERT_TYPE(args, "str-find", 1, LTYPE(args->cell[0]), LVAL_STR);
+	LASSERT_TYPE(args, "str-find", 2, LTYPE(args->cell[1]), LVAL_STR);
+
+	lval* x = lval_num(lval_str_find(args->cell[1], args->cell[0], 0));
+	lval_del(args);
+	return x;
+
+}
+
+//Split the second string at every place the first appears in it
+lval* builtin_str_split(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "str-split", args->count, 2);
+	LASSERT_TYPE(args, "str-split", 1, LTYPE(args->cell[0]), LVAL_STR);
+	LASSERT_TYPE(args, "str-split", 2, LTYPE(args->cell[1]), LVAL_STR);
+	LASSERT(args, (args->cell[0]->len == 0), "Function \"%s\" passed an empty separator", "str-split");
+
+	lval* sep = args->cell[0];
+	lval* s = args->cell[1];
+	lval* result = lval_qexpr();
+	int from = 0;
+	for(int at; (at = lval_str_find(s, sep, from)) >= 0; from = at + sep->len)
+		lval_append(result, lval_substr(lval_copy(s), from, at));
+	lval_append(result, lval_substr(lval_copy(s), from, s->len));
+
+	lval_del(args);
+	return result;
+
+}
+
+//Check that argument arg can be the key of a map
+#define LASSERT_KEY(args, func, arg) do { \
+	enum ltype type = LTYPE((args)->cell[(arg) - 1]); \
+	LASSERT((args), !LMAP_KEY(type), "Function \"%s\" passed a %s as a key for argument %i, expected a number, string, or symbol", (func), ltype_name(type), (arg)); \
+} while(false)
+
+//A map from each key in a list to the value after it, which like vec's numbers aren't evaluated
+lval* builtin_map_new(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "map-new", args->count, 1);
+	LASSERT_TYPE(args, "map-new", 1, LTYPE(args->cell[0]), LVAL_QEXPR);
+
+	lval* l = args->cell[0];
+	LASSERT(args, (l->count % 2), "Function \"map-new\" passed a list of length %i, expected keys and values in pairs", l->count);
+	for(int i = 0; i < l->count; i += 2)
+		LASSERT(args, !LMAP_KEY(LTYPE(l->cell[i])), "Function \"map-new\" passed a %s as a key for element %i, expected a number, string, or symbol",
+			ltype_name(LTYPE(l->cell[i])), i);
+
+	lval* m = lval_map();
+	for(int i = 0; i < l->count; i += 2)
+		m = lmap_put(m, lval_copy(l->cell[i]), lval_copy(l->cell[i + 1]));
+	lval_del(args);
+	return m;
+
+}
+
+//The value a key maps to, or the third argument if there isn't one
+lval* builtin_map_get(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT(args, (args->count != 2 && args->count != 3), "Function \"map-get\" passed wrong number of args: got %i, expected 2 or 3", args->count);
+	LASSERT_KEY(args, "map-get", 1);
+	LASSERT_TYPE(args, "map-get", 2, LTYPE(args->cell[1]), LVAL_MAP);
 
+	lval* x = lmap_get(args->cell[1], args->cell[0]);
+	if(x) x = lval_copy(x);
+	else if(args->count == 3) x = lval_pop(args, 2);
+	LASSERT(args, !x, "Function \"%s\" passed a key which isn't in the map", "map-get");
+
+	lval_del(args);
+	return x;
+
+}
+
+lval* builtin_map_put(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "map-put", args->count, 3);
+	LASSERT_KEY(args, "map-put", 1);
+	LASSERT_TYPE(args, "map-put", 3, LTYPE(args->cell[2]), LVAL_MAP);
+
+	lval* m = lval_own(lval_pop(args, 2));
+	lval* k = lval_pop(args, 0);
+	m = lmap_put(m, k, lval_pop(args, 0));
+	lval_del(args);
+	return m;
+
+}
+
+lval* builtin_map_del(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "map-del", args->count, 2);
+	LASSERT_KEY(args, "map-del", 1);
+	LASSERT_TYPE(args, "map-del", 2, LTYPE(args->cell[1]), LVAL_MAP);
+
+	lval* m = lval_pop(args, 1);
+	if(lmap_get(m, args->cell[0])) m = lmap_del(lval_own(m), args->cell[0]);  //Don't copy the map for nothing
+	lval_del(args);
+	return m;
+
+}
+
+lval* builtin_map_keys(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "map-keys", args->count, 1);
+	LASSERT_TYPE(args, "map-keys", 1, LTYPE(args->cell[0]), LVAL_MAP);
+
+	lval* m = args->cell[0];
+	lval* keys = lval_qexpr();
+	lval_reserve(keys, m->nkeys);
+	for(int i = 0; i < m->nslots; i++)
+		if(LMAP_FULL(m, i)) keys->cell[keys->count++] = lval_copy(m->slots[i].key);
+
+	lval_del(args);
+	return keys;
+
+}
+
+lval* builtin_map_size(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "map-size", args->count, 1);
+	LASSERT_TYPE(args, "map-size", 1, LTYPE(args->cell[0]), LVAL_MAP);
+
+	lval* x = lval_num(args->cell[0]->nkeys);
 	lval_del(args);
 	return x;
 
 }
 
+#undef LASSERT_KEY
+
 typedef enum var {VAR_DEF, VAR_PUT} var;
 
 static lval* builtin_var(lenv* e, lval* args, var func) {
 
-	LASSERT_TYPE(args, "def", 0, args->cell[0]->type, LVAL_QEXPR);
+	LASSERT_TYPE(args, "def", 0, LTYPE(args->cell[0]), LVAL_QEXPR);
 
 	lval* syms = args->cell[0];
 
 	for(int i = 0; i < syms->count; i++)
-		LASSERT_TYPE(args, "def", i+1, syms->cell[i]->type, LVAL_SYM);
+		LASSERT_TYPE(args, "def", i+1, LTYPE(syms->cell[i]), LVAL_SYM);
 
 	LASSERT_ARGS(args, "def", syms->count, args->count - 1);
 
@@ -606,11 +1254,11 @@ lval* builtin_lambda(lenv* e, lval* args) {
 	UNUSED(e);
 	
 	LASSERT_ARGS(args, "\\", args->count, 2);
-	LASSERT_TYPE(args, "\\", 1, args->cell[0]->type, LVAL_QEXPR);
-	LASSERT_TYPE(args, "\\", 2, args->cell[1]->type, LVAL_QEXPR);
+	LASSERT_TYPE(args, "\\", 1, LTYPE(args->cell[0]), LVAL_QEXPR);
+	LASSERT_TYPE(args, "\\", 2, LTYPE(args->cell[1]), LVAL_QEXPR);
 
 	for(int i = 0; i < args->cell[0]->count; i++)
-		LASSERT_TYPE(args, "\\", i+1, args->cell[0]->cell[i]->type, LVAL_SYM);
+		LASSERT_TYPE(args, "\\", i+1, LTYPE(args->cell[0]->cell[i]), LVAL_SYM);
 
 	lval* formals = lval_pop(args, 0);
 	lval* body = lval_pop(args, 0);
@@ -641,21 +1289,23 @@ lval* builtin_eq(lenv* e, lval* args) {
 
 }
 
+//Returns the branch to take as an sexpr, which lval_eval() evaluates in tail position
 lval* builtin_if(lenv* e, lval* args) {
 
-	LASSERT_ARGS(args, "if", args->count, 3);
-	LASSERT_TYPE(args, "if", 1, args->cell[0]->type, LVAL_BOOL);
-	LASSERT_TYPE(args, "if", 2, args->cell[1]->type, LVAL_QEXPR);
-	LASSERT_TYPE(args, "if", 3, args->cell[2]->type, LVAL_QEXPR);
+	UNUSED(e);
 
-	args->cell[1]->type = LVAL_SEXPR;
-	args->cell[2]->type = LVAL_SEXPR;
+	LASSERT_ARGS(args, "if", args->count, 3);
+	LASSERT_TYPE(args, "if", 1, LTYPE(args->cell[0]), LVAL_BOOL);
+	LASSERT_TYPE(args, "if", 2, LTYPE(args->cell[1]), LVAL_QEXPR);
+	LASSERT_TYPE(args, "if", 3, LTYPE(args->cell[2]), LVAL_QEXPR);
 
-	lval* result;
-	if(args->cell[0] == LVAL_TRUE) result = lval_eval(e, lval_pop(args, 1));
-	else result = lval_eval(e, lval_pop(args, 2));
+	lval* branch;
+	if(args->cell[0] == LVAL_TRUE) branch = lval_own(lval_pop(args, 1));
+	else branch = lval_own(lval_pop(args, 2));
 	lval_del(args);
-	return result;
+
+	branch->type = LVAL_SEXPR;
+	return branch;
 
 }
 
@@ -664,8 +1314,8 @@ lval* builtin_nand(lenv* e, lval* args) {
 	UNUSED(e);
 	
 	LASSERT_ARGS(args, "not", args->count, 2);
-	LASSERT_TYPE(args, "not", 1, args->cell[0]->type, LVAL_BOOL);
-	LASSERT_TYPE(args, "not", 2, args->cell[1]->type, LVAL_BOOL);
+	LASSERT_TYPE(args, "not", 1, LTYPE(args->cell[0]), LVAL_BOOL);
+	LASSERT_TYPE(args, "not", 2, LTYPE(args->cell[1]), LVAL_BOOL);
 
 	lval* x = args->cell[0];
 	lval* y = args->cell[1];
@@ -674,8 +1324,6 @@ lval* builtin_nand(lenv* e, lval* args) {
 
 }
 
-typedef enum rel {REL_LT, REL_GT, REL_GTE, REL_LTE} rel;
-
 char* rel_name(rel func) {
 	switch(func) {
 		case(REL_GT):
@@ -686,6 +1334,8 @@ char* rel_name(rel func) {
 			return "<";
 		case(REL_LTE):
 			return "<=";
+		case(REL_EQ):
+			return "==";
 		default:
 			return "Not a comparison function!";
 	}
@@ -696,12 +1346,17 @@ lval* builtin_compare(lenv* e, lval* args, rel func) {
 	UNUSED(e);
 	
 	LASSERT_ARGS(args, rel_name(func), args->count, 2);
-	LASSERT_TYPE(args, rel_name(func), 1, args->cell[0]->type, LVAL_NUM);
-	LASSERT_TYPE(args, rel_name(func), 2, args->cell[1]->type, LVAL_NUM);
+	for(int i = 0; i < 2; i++)
+		if(!LNUMERIC(LTYPE(args->cell[i]))) LASSERT_TYPE(args, rel_name(func), i + 1, LTYPE(args->cell[i]), LVAL_NUM);
+
+	int c;
+	if(LTYPE(args->cell[0]) == LVAL_NUM && LTYPE(args->cell[1]) == LVAL_NUM)
+		c = (LNUM(args->cell[0]) > LNUM(args->cell[1])) - (LNUM(args->cell[0]) < LNUM(args->cell[1]));
+	else c = lnum_compare(args->cell[0], args->cell[1]);
 
 	lval* result;
 	switch(func) {
-		#define ADD_REL(relation, op) case(relation): result = (args->cell[0]->num op args->cell[1]->num) ? LVAL_TRUE : LVAL_FALSE; break
+		#define ADD_REL(relation, op) case(relation): result = (c op 0) ? LVAL_TRUE : LVAL_FALSE; break
 		ADD_REL(REL_GT, >);
 		ADD_REL(REL_GTE, >=);
 		ADD_REL(REL_LT, <);
@@ -718,50 +1373,29 @@ lval* builtin_compare(lenv* e, lval* args, rel func) {
 lval* builtin_gt(lenv* e, lval* args) { return builtin_compare(e, args, REL_GT);  }
 lval* builtin_lt(lenv* e, lval* args) { return builtin_compare(e, args, REL_LT);  }
 lval* builtin_gte(lenv* e, lval* args) { return builtin_compare(e, args, REL_GTE); }
-lval* builtin_lte(lenv* e, lval* args) { return builtin_compare(e, args, REL_GT); }
+lval* builtin_lte(lenv* e, lval* args) { return builtin_compare(e, args, REL_LTE); }
 
 lval* builtin_load(lenv* e, lval* args) {
 
 	LASSERT_ARGS(args, "load", args->count, 1);
-	LASSERT_TYPE(args, "load", 1, args->cell[0]->type, LVAL_STR);
+	LASSERT_TYPE(args, "load", 1, LTYPE(args->cell[0]), LVAL_STR);
 
 	//Load the file
-	mpc_result_t result;
-	int error;
-	char* filename = args->cell[0]->str;	
-	if(strcmp(filename, "stdin") == 0)
-		error = mpc_parse_pipe(filename, stdin, Lisp, &result);
-	else 
-		error = mpc_parse_contents(filename, Lisp, &result);
-	if(error) {
-		//Parse it
-		//mpc_ast_print(result.output);
-		lval* expr = lval_read(result.output);
-		mpc_ast_delete(result.output);
-
-		//Evaluate it
-		while(expr->count) {
-			lval* v = lval_eval(e, lval_pop(expr, 0));
-			if(v->type == LVAL_ERR) lval_println(v);
-			lval_del(v);
-		}
-
-		//Cleanup
-		lval_del(expr);
+	char* filename = lval_str_cstr(args->cell[0]);	
+	if(strcmp(filename, "stdin") == 0) {
 		lval_del(args);
+		return load(e, lstream_new("stdin", stdin));
+	}
 
-		return lval_sexp();
-	} else {
-		//There was an error
-		char* err_msg = mpc_err_string(result.error);
-		mpc_err_delete(result.error);
-
-		lval* err = lval_err("Could not load file: %s", err_msg);
-		free(err_msg);
+	lstream* s = lstream_open(filename);
+	if(s == NULL) {
+		lval* err = lval_err("Could not load file: %s: %s", filename, strerror(errno));
 		lval_del(args);
-
 		return err;
 	}
+	lval* result = load(e, s);  //filename is only used for errors, so args has to outlive it
+	lval_del(args);
+	return result;
 
 }
 
@@ -770,24 +1404,40 @@ lval* builtin_print(lenv* e, lval* args) {
 	UNUSED(e);
 	
 	for(int i = 0; i < args->count; i++) {
-		lval_print(args->cell[i]);
-		putchar(' ');
+		lval_print(&lbuf_out, args->cell[i]);
+		lbuf_putc(&lbuf_out, ' ');
 	}
 
-	putchar('\n');
+	lbuf_putc(&lbuf_out, '\n');
 	lval_del(args);
 	return lval_sexp();
 
 }
 
+//Print a value into a string, the same way print would
+lval* builtin_to_string(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "to-string", args->count, 1);
+
+	lbuf b = {-1, NULL, 0, 0};
+	lval_print(&b, args->cell[0]);
+	lval* str = lval_str_n(b.data, b.len);
+	free(b.data);
+
+	lval_del(args);
+	return str;
+
+}
+
 lval* builtin_err(lenv* e, lval* args) {
 
 	UNUSED(e);
 	
 	LASSERT_ARGS(args, "print", args->count, 1);
-	LASSERT_TYPE(args, "print", 1, args->cell[0]->type, LVAL_STR);
+	LASSERT_TYPE(args, "print", 1, LTYPE(args->cell[0]), LVAL_STR);
 
-	lval* err = lval_err(args->cell[0]->str);
+	lval* err = lval_err("%s", lval_str_cstr(args->cell[0]));
 	lval_del(args);
 	return err;
 
@@ -799,33 +1449,132 @@ lval* builtin_exit(lenv* e, lval* args) {
 
 	int status;
 	if(args->count) {
-		LASSERT_TYPE(args, "exit", 1, args->cell[0]->type, LVAL_NUM);
-		status = args->cell[0]->num;
+		LASSERT_TYPE(args, "exit", 1, LTYPE(args->cell[0]), LVAL_NUM);
+		status = LNUM(args->cell[0]);
 	} else status = 0;
 
 	lenv_del(e);
-	mpc_cleanup(9, Number, Boolean, String, Comment, Symbol, Sexpr, Qexpr, Expr, Lisp);
+	lpool_cleanup();
+	lsym_cleanup();
 
 	exit(status);
 
 }
 
+//Write the global environment to a file which --image can start from
+lval* builtin_save_image(lenv* e, lval* args) {
+
+	LASSERT_ARGS(args, "save-image", args->count, 1);
+	LASSERT_TYPE(args, "save-image", 1, LTYPE(args->cell[0]), LVAL_STR);
+
+	while(e->par) e = e->par;
+	char* filename = lval_str_cstr(args->cell[0]);
+	FILE* f = fopen(filename, "wb");
+	char* why = f ? lser_save_env(e, f) : strerror(errno);
+	if(f && fclose(f) && !why) why = strerror(errno);
+	if(why && f) remove(filename);  //Don't leave half an image for --image to trip over
+	LASSERT(args, why, "Could not save image: %s: %s", filename, why);
+
+	lval_del(args);
+	return lval_sexp();
+
+}
+
+//Write a value to a file, or to stdout, so deserialize can read it back
+lval* builtin_serialize(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "serialize", args->count, 2);
+	LASSERT_TYPE(args, "serialize", 1, LTYPE(args->cell[0]), LVAL_STR);
+
+	char* filename = lval_str_cstr(args->cell[0]);
+	bool std = strcmp(filename, "stdout") == 0;
+	if(std) lbuf_flush(&lbuf_out);  //Keep it in order with what's been printed
+	FILE* f = std ? stdout : fopen(filename, "wb");
+	char* why = f ? lser_save(args->cell[1], f) : strerror(errno);
+	if(f && (std ? fflush(f) : fclose(f)) && !why) why = strerror(errno);
+	if(why && f && !std) remove(filename);
+	LASSERT(args, why, "Could not serialize to %s: %s", filename, why);
+
+	lval_del(args);
+	return lval_sexp();
+
+}
+
+lval* builtin_deserialize(lenv* e, lval* args) {
+
+	UNUSED(e);
+	LASSERT_ARGS(args, "deserialize", args->count, 1);
+	LASSERT_TYPE(args, "deserialize", 1, LTYPE(args->cell[0]), LVAL_STR);
+
+	char* filename = lval_str_cstr(args->cell[0]);
+	bool std = strcmp(filename, "stdin") == 0;
+	FILE* f = std ? stdin : fopen(filename, "rb");
+	LASSERT(args, !f, "Could not deserialize from %s: %s", filename, strerror(errno));
+
+	lval* v = lser_load(f);
+	if(!std) fclose(f);
+	lval_del(args);
+	return v;
+
+}
+
+//Return {live slabs peak} for the named allocation pool
+lval* builtin_pool_stats(lenv* e, lval* args) {
+
+	UNUSED(e);
+
+	LASSERT_ARGS(args, "pool-stats", args->count, 1);
+	LASSERT_TYPE(args, "pool-stats", 1, LTYPE(args->cell[0]), LVAL_STR);
+
+	char* name = lval_str_cstr(args->cell[0]);
+#ifdef LISP_GC_MARK_SWEEP
+	if(strcmp(name, "gc") == 0) {
+		lval_del(args);
+		return lpool_gc_stats();
+	}
+	if(strcmp(name, "nursery") == 0) {
+		lval_del(args);
+		return lpool_nursery_stats();
+	}
+#endif
+
+	lpool* pool = NULL;
+	if(strcmp(name, lval_pool.name) == 0) pool = &lval_pool;
+	if(strcmp(name, lenv_pool.name) == 0) pool = &lenv_pool;
+	LASSERT(args, (pool == NULL), "Function \"pool-stats\" passed unknown pool: \"%s\"", name);
+
+	lval_del(args);
+	return lpool_stats(pool);
+
+}
+
 #undef LASSERT
 #undef LASSERT_TYPE
 #undef LASSERT_ARGS
 #undef LASSERT_EMPTY
 
-#define ADD_BUILTIN(name, operator) lval* builtin_##name(lenv* e, lval* a) { return builtin_op(e, a, #operator); }
-ADD_BUILTIN(add, +)
-ADD_BUILTIN(sub, -)
-ADD_BUILTIN(mul, *)
-ADD_BUILTIN(div, /)
-ADD_BUILTIN(mod, %)
-ADD_BUILTIN(pow, ^)
-ADD_BUILTIN(min, min)
-ADD_BUILTIN(max, max)
+#define ADD_BUILTIN(name, operator) lval* builtin_##name(lenv* e, lval* a) { return builtin_op(e, a, operator); }
+ADD_BUILTIN(add, ARITH_ADD)
+ADD_BUILTIN(sub, ARITH_SUB)
+ADD_BUILTIN(mul, ARITH_MUL)
+ADD_BUILTIN(div, ARITH_DIV)
+ADD_BUILTIN(mod, ARITH_MOD)
+ADD_BUILTIN(pow, ARITH_POW)
+ADD_BUILTIN(min, ARITH_MIN)
+ADD_BUILTIN(max, ARITH_MAX)
 #undef ADD_BUILTIN
 
+lval* builtin_vsum(lenv* e, lval* a) { return builtin_vfold(e, a, ARITH_ADD, "vsum"); }
+lval* builtin_vprod(lenv* e, lval* a) { return builtin_vfold(e, a, ARITH_MUL, "vprod"); }
+lval* builtin_vmin(lenv* e, lval* a) { return builtin_vfold(e, a, ARITH_MIN, "vmin"); }
+lval* builtin_vmax(lenv* e, lval* a) { return builtin_vfold(e, a, ARITH_MAX, "vmax"); }
+lval* builtin_vadd(lenv* e, lval* a) { return builtin_vmap(e, a, ARITH_ADD, "v+"); }
+lval* builtin_vmul(lenv* e, lval* a) { return builtin_vmap(e, a, ARITH_MUL, "v*"); }
+lval* builtin_vlt(lenv* e, lval* a) { return builtin_vcompare(e, a, REL_LT, "v<"); }
+lval* builtin_vgt(lenv* e, lval* a) { return builtin_vcompare(e, a, REL_GT, "v>"); }
+lval* builtin_veq(lenv* e, lval* a) { return builtin_vcompare(e, a, REL_EQ, "v=="); }
+
 void lenv_add_builtins(lenv* e) {
 
 	#define ADD_BUILTIN(operator, func) do{ lenv_add_builtin(e, #operator, builtin_##func); } while(false)
@@ -842,6 +1591,39 @@ void lenv_add_builtins(lenv* e) {
 	ADD_BUILTIN(tail,tail);
 	ADD_BUILTIN(eval,eval);
 	ADD_BUILTIN(join,join);
+	ADD_BUILTIN(len, len);
+	ADD_BUILTIN(nth, nth);
+	ADD_BUILTIN(last, last);
+	ADD_BUILTIN(take, take);
+	ADD_BUILTIN(drop, drop);
+	ADD_BUILTIN(elem, elem);
+	ADD_BUILTIN(map, map);
+	ADD_BUILTIN(filter, filter);
+	ADD_BUILTIN(foldl, foldl);
+	ADD_BUILTIN(range, range);
+	ADD_BUILTIN(vec, vec);
+	ADD_BUILTIN(vec-list, vec_list);
+	ADD_BUILTIN(vsum, vsum);
+	ADD_BUILTIN(vprod, vprod);
+	ADD_BUILTIN(vmin, vmin);
+	ADD_BUILTIN(vmax, vmax);
+	ADD_BUILTIN(vdot, vdot);
+	ADD_BUILTIN(v+, vadd);
+	ADD_BUILTIN(v*, vmul);
+	ADD_BUILTIN(v<, vlt);
+	ADD_BUILTIN(v>, vgt);
+	ADD_BUILTIN(v==, veq);
+	ADD_BUILTIN(str-len, str_len);
+	ADD_BUILTIN(str-cat, str_cat);
+	ADD_BUILTIN(substr, substr);
+	ADD_BUILTIN(str-find, str_find);
+	ADD_BUILTIN(str-split, str_split);
+	ADD_BUILTIN(map-new, map_new);
+	ADD_BUILTIN(map-get, map_get);
+	ADD_BUILTIN(map-put, map_put);
+	ADD_BUILTIN(map-del, map_del);
+	ADD_BUILTIN(map-keys, map_keys);
+	ADD_BUILTIN(map-size, map_size);
 	ADD_BUILTIN(def, def);
 	ADD_BUILTIN(=, put);
 	ADD_BUILTIN(\\, lambda);
@@ -853,9 +1635,14 @@ void lenv_add_builtins(lenv* e) {
 	ADD_BUILTIN(<, lt);
 	ADD_BUILTIN(<=, lte);
 	ADD_BUILTIN(load, load);
+	ADD_BUILTIN(save-image, save_image);
+	ADD_BUILTIN(serialize, serialize);
+	ADD_BUILTIN(deserialize, deserialize);
 	ADD_BUILTIN(print, print);
+	ADD_BUILTIN(to-string, to_string);
 	ADD_BUILTIN(exit, exit);
 	ADD_BUILTIN(err, err);
+	ADD_BUILTIN(pool-stats, pool_stats);
 	#undef ADD_BUILTIN
 
 }
@@ -48,68 +48,13 @@
 (fun {comp f g x} {f (g x)})
 
 ;List funcs
+;len, nth, last, take, drop, elem, map, filter, foldl and range are builtins
 (fun {fst l} {eval (head l)})
 (fun {snd l} {eval (head (tail l))})
 (fun {trd l} {eval (head (tail (tail l)))})
 
-(fun {len l} {
-  if (== l nil)
-    {0}
-    {+ 1 (len (tail l))}
-})
-
-;Nth item
-(fun {nth n l} {
-  if(== n 0)
-    {fst l}
-    {nth (- n 1) (tail l)}
-})
-
-(fun {last l} {nth (- (len l) 1) l})
-
-(fun {take n l} {
-  if (== n 0)
-    {nil}
-    {join (head l) (take (- n 1) (tail l))}
-})
-
-(fun {drop n l} {
-  if (== n 0)
-    {l}
-    {drop (- n 1) (tail l)}
-})
-
 (fun {split n l} {list (split n l) (drop n l)})
 
-(fun {elem x l} {
-  if (== l nil)
-    {false}
-    {if (== x (fst l))
-      {true}
-      {elem x (tail l)}}
-})
-
-(fun {map f l} {
-  if (== l nil)
-    {nil}
-    {join (list (f (fst l))) (map f (tail l))}
-})
-
-(fun {filter f l} {
-  if (== l nil)
-    {nil}
-    {join (if (f (fst l))
-      {head l}
-      {nil}
-    ) (filter f (tail l))}
-})
-
-(fun {foldl f z l} {
-  if (== l nil)
-    {z}
-    {foldl f (f z (fst l)) (tail l)}
-})
-
 (fun {sum l} {foldl + 0 l})
 (fun {product l} {foldl * 1 l})
 
@@ -128,9 +73,3 @@
     {error "No Case Found"}
     {if (== x (fst (fst cs))) {snd (fst cs)} {unpack case (join (list x) (tail cs))}}
 })
-
-(fun {range begin end} {
-  if (> begin end)
-    {nil}
-    {join (list begin) (range (+ begin 1) end)}
-})